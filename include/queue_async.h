@@ -0,0 +1,297 @@
+#pragma once
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+
+#include <atomic>
+#include <coroutine>
+#include <tuple>
+#include <utility>
+#include <cstddef>
+
+#include "queue_spsc.h"
+
+namespace async {
+
+/*
+ * Awaitable push and pop over a bounded ring (spsc::qring, mpmc::qring2).
+ *
+ * co_await q.async_pop() suspends the coroutine while the ring is empty,
+ * co_await q.async_push(v) while it is full.
+ * A suspended coroutine sits in a lock-free list of waiters. The counterpart operation
+ * takes the list, does the push or pop on each waiter's behalf and resumes it on its own thread,
+ * so no thread ever spins or blocks to wait.
+ * Operations that don't have to wait only pay for a fence and a load of the list.
+ *
+ * After quit(), waiters are resumed and fail if their operation still can't be done.
+ * With spsc::qring there must still be a single producer and a single consumer coroutine.
+ *
+ * Q needs try_emplace(), try_pop(), and empty()/full() that are exact for published elements.
+*/
+template <typename Q>
+class queue {
+public:
+    using value_type = typename Q::value_type;
+
+private:
+    struct waiter {
+        waiter*                 next_ = nullptr;
+        std::coroutine_handle<> handle_;
+        value_type              val_;
+        bool                    ok_ = false;
+
+        template <typename... P>
+        explicit waiter(P&&... pars)
+            : val_(std::forward<P>(pars)...)
+        {}
+    };
+
+    // Waiter stacks, only ever taken as a whole, so there is no ABA.
+    alignas(spsc::cache_line_size) std::atomic<waiter*> poppers_ { nullptr };
+    alignas(spsc::cache_line_size) std::atomic<waiter*> pushers_ { nullptr };
+    alignas(spsc::cache_line_size) std::atomic<bool>    quit_    { false };
+
+    Q que_;
+
+    bool quitted() const {
+        return quit_.load(std::memory_order_acquire);
+    }
+
+    std::atomic<waiter*>& list_of(bool popper) {
+        return popper ? poppers_ : pushers_;
+    }
+
+    bool available(bool popper) const {
+        return popper ? !que_.empty() : !que_.full();
+    }
+
+    static void put_back(std::atomic<waiter*>& list, waiter* first, waiter* last) {
+        last->next_ = list.load(std::memory_order_relaxed);
+        while (!list.compare_exchange_weak(last->next_, first, std::memory_order_release, std::memory_order_relaxed)) ;
+    }
+
+    // A waiter is done when its operation succeeded, or will never succeed.
+    bool serve(bool popper, waiter* w) {
+        w->ok_ = popper ? que_.try_pop(w->val_) : que_.try_emplace(std::move(w->val_));
+        return w->ok_ || quitted();
+    }
+
+    /*
+     * Serves the waiters of one side, oldest first, and resumes those that are done, except self.
+     * The others go back to the list, and are tried again if the ring changed meanwhile:
+     * a counterpart that found the list empty while we held them doesn't come back for them.
+     * Returns how many operations were done.
+    */
+    std::size_t drain(bool popper, waiter* self, bool& self_done) {
+        auto& list = list_of(popper);
+        std::size_t served = 0;
+        while (1) {
+            auto w = list.exchange(nullptr, std::memory_order_acquire);
+            if (w == nullptr) break;
+            waiter* todo = nullptr;
+            while (w != nullptr) {
+                auto next = w->next_;
+                w->next_ = todo;
+                todo = w;
+                w = next;
+            }
+            waiter* done = nullptr, * rest = nullptr, * last = nullptr;
+            while (todo != nullptr) {
+                auto next = todo->next_;
+                if (serve(popper, todo)) {
+                    if (todo->ok_) ++served;
+                    todo->next_ = done;
+                    done = todo;
+                }
+                else {
+                    todo->next_ = nullptr;
+                    if (last == nullptr) rest = todo;
+                    else last->next_ = todo;
+                    last = todo;
+                }
+                todo = next;
+            }
+            if (rest != nullptr) {
+                put_back(list, rest, last);
+            }
+            while (done != nullptr) {
+                auto next = done->next_;
+                if (done == self) self_done = true;
+                else done->handle_.resume();
+                done = next;
+            }
+            if (rest == nullptr) break;
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (!available(popper) && !quitted()) break;
+        }
+        return served;
+    }
+
+    /*
+     * Called after the ring changed for the waiters of one side.
+     * Serving them changes it for the other side in turn, so keep going while anything is done.
+    */
+    void wake(bool popper, waiter* self, bool& self_done) {
+        while (1) {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (list_of(popper).load(std::memory_order_relaxed) == nullptr) break;
+            if (drain(popper, self, self_done) == 0) break;
+            popper = !popper;
+        }
+    }
+
+    void notify(bool popper) {
+        bool unused = false;
+        wake(popper, nullptr, unused);
+    }
+
+    /*
+     * Parks w, then checks the ring once more in case the counterpart came by before w was listed.
+     * Returns false if w got served right here, and must not touch w otherwise:
+     * another thread may have resumed it already.
+    */
+    bool suspend(bool popper, waiter* w) {
+        auto& list = list_of(popper);
+        put_back(list, w, w);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        bool self_done = false;
+        if (available(popper) || quitted()) {
+            if (drain(popper, w, self_done) != 0) {
+                wake(!popper, w, self_done);
+            }
+        }
+        return !self_done;
+    }
+
+public:
+    class pop_awaiter {
+        friend class queue;
+
+        queue* que_;
+        waiter w_;
+
+        explicit pop_awaiter(queue* q) : que_(q) {}
+
+    public:
+        pop_awaiter(pop_awaiter const &) = delete;
+        pop_awaiter& operator=(pop_awaiter const &) = delete;
+
+        bool await_ready() {
+            w_.ok_ = que_->try_pop(w_.val_);
+            return w_.ok_ || que_->quitted();
+        }
+
+        bool await_suspend(std::coroutine_handle<> h) {
+            w_.handle_ = h;
+            return que_->suspend(true, &w_);
+        }
+
+        std::tuple<value_type, bool> await_resume() {
+            return { std::move(w_.val_), w_.ok_ };
+        }
+    };
+
+    class push_awaiter {
+        friend class queue;
+
+        queue* que_;
+        waiter w_;
+
+        template <typename... P>
+        explicit push_awaiter(queue* q, P&&... pars)
+            : que_(q), w_(std::forward<P>(pars)...)
+        {}
+
+    public:
+        push_awaiter(push_awaiter const &) = delete;
+        push_awaiter& operator=(push_awaiter const &) = delete;
+
+        bool await_ready() {
+            w_.ok_ = que_->push(std::move(w_.val_));
+            return w_.ok_ || que_->quitted();
+        }
+
+        bool await_suspend(std::coroutine_handle<> h) {
+            w_.handle_ = h;
+            return que_->suspend(false, &w_);
+        }
+
+        bool await_resume() {
+            return w_.ok_;
+        }
+    };
+
+    template <typename... P>
+    explicit queue(P&&... pars)
+        : que_(std::forward<P>(pars)...)
+    {}
+
+    queue(queue const &) = delete;
+    queue& operator=(queue const &) = delete;
+
+    void quit() {
+        quit_.store(true, std::memory_order_release);
+        que_.quit();
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        bool unused = false;
+        drain(true , nullptr, unused);
+        drain(false, nullptr, unused);
+    }
+
+    bool empty() const {
+        return que_.empty();
+    }
+
+    // Never waits, returns false when the ring is full.
+    template <typename... P>
+    bool emplace(P&&... pars) {
+        if (!que_.try_emplace(std::forward<P>(pars)...)) {
+            return false;
+        }
+        notify(true);
+        return true;
+    }
+
+    bool push(value_type const & val) {
+        return emplace(val);
+    }
+
+    bool push(value_type&& val) {
+        return emplace(std::move(val));
+    }
+
+    bool try_pop(value_type& val) {
+        if (!que_.try_pop(val)) {
+            return false;
+        }
+        notify(false);
+        return true;
+    }
+
+    bool pop(value_type& val) {
+        return try_pop(val);
+    }
+
+    std::tuple<value_type, bool> pop() {
+        std::tuple<value_type, bool> ret {};
+        std::get<1>(ret) = pop(std::get<0>(ret));
+        return ret;
+    }
+
+    // co_await yields std::tuple<value_type, bool>, the flag is false after quit() on an empty ring.
+    pop_awaiter async_pop() {
+        return pop_awaiter { this };
+    }
+
+    // co_await yields false after quit() on a full ring.
+    push_awaiter async_push(value_type const & val) {
+        return push_awaiter { this, val };
+    }
+
+    push_awaiter async_push(value_type&& val) {
+        return push_awaiter { this, std::move(val) };
+    }
+};
+
+} // namespace async
+
+#endif // __cpp_impl_coroutine
@@ -0,0 +1,128 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <tuple>
+#include <utility>
+
+#include "queue_wait.h"
+
+namespace blocking {
+
+/*
+ * Adds blocking pops to any of the non-blocking queues (mpmc::queue, mpmc::qring, spsc::qring, ...).
+ *
+ * Consumers spin on try_pop() for a while, then park on an eventcount.
+ * Producers only pay for a fence and a load after each push,
+ * no lock is taken and no syscall is made unless a consumer has parked.
+*/
+template <typename Q, unsigned SpinN = 64>
+class queue {
+public:
+    using value_type = typename Q::value_type;
+
+private:
+    Q que_;
+    wait_strategy::eventcount ec_;
+    std::atomic<bool> quit_ { false };
+
+    bool spin_pop(value_type& val) {
+        for (unsigned k = 0; k < SpinN; ++k) {
+            if (que_.try_pop(val)) return true;
+            wait_strategy::detail::cpu_pause();
+        }
+        return que_.try_pop(val);
+    }
+
+    bool quitted() const {
+        return quit_.load(std::memory_order_acquire);
+    }
+
+public:
+    template <typename... P>
+    explicit queue(P&&... pars)
+        : que_(std::forward<P>(pars)...)
+    {}
+
+    ~queue() {
+        quit();
+    }
+
+    void quit() {
+        quit_.store(true, std::memory_order_release);
+        que_.quit();
+        ec_.notify();
+    }
+
+    bool empty() const {
+        return que_.empty();
+    }
+
+    template <typename... P>
+    bool emplace(P&&... pars) {
+        if (!que_.emplace(std::forward<P>(pars)...)) {
+            return false;
+        }
+        ec_.notify();
+        return true;
+    }
+
+    bool push(value_type const & val) {
+        return emplace(val);
+    }
+
+    bool push(value_type&& val) {
+        return emplace(std::move(val));
+    }
+
+    bool try_pop(value_type& val) {
+        return que_.try_pop(val);
+    }
+
+    // Waits until an element arrives, returns false after quit().
+    bool pop(value_type& val) {
+        while (!spin_pop(val)) {
+            if (quitted()) return false;
+            auto key = ec_.prepare_wait();
+            if (que_.try_pop(val)) {
+                ec_.cancel_wait();
+                return true;
+            }
+            if (quitted()) {
+                ec_.cancel_wait();
+                return false;
+            }
+            ec_.commit_wait(key);
+        }
+        return true;
+    }
+
+    // Like pop(), but gives up when the timeout expires.
+    template <typename Rep, typename Period>
+    bool pop_wait(value_type& val, std::chrono::duration<Rep, Period> const & timeout) {
+        auto deadline = std::chrono::steady_clock::now() + timeout;
+        while (!spin_pop(val)) {
+            if (quitted()) return false;
+            auto key = ec_.prepare_wait();
+            if (que_.try_pop(val)) {
+                ec_.cancel_wait();
+                return true;
+            }
+            auto now = std::chrono::steady_clock::now();
+            if (quitted() || (now >= deadline)) {
+                ec_.cancel_wait();
+                return false;
+            }
+            ec_.commit_wait(key, deadline - now);
+        }
+        return true;
+    }
+
+    std::tuple<value_type, bool> pop() {
+        std::tuple<value_type, bool> ret {};
+        std::get<1>(ret) = pop(std::get<0>(ret));
+        return ret;
+    }
+};
+
+} // namespace blocking
@@ -2,26 +2,55 @@
 
 #include <tuple>
 #include <mutex>
-#include <memory>
-#include <functional>
+#include <atomic>
+#include <new>
+#include <utility>
+#include <type_traits>
+#include <cstddef>
 
 namespace lock {
 
+namespace detail {
+
+// Parentheses when T has a matching constructor, braces otherwise, so aggregates can be emplaced too.
+template <typename T, typename... P>
+T make(P&&... pars) {
+    if constexpr (std::is_constructible<T, P&&...>::value) {
+        return T(std::forward<P>(pars)...);
+    }
+    else {
+        return T { std::forward<P>(pars)... };
+    }
+}
+
+} // namespace detail
+
 template <typename T>
 class pool {
 
     union node {
         T     data_;
         node* next_;
+
+        ~node() {}
     } * cursor_ = nullptr;
 
     mutable std::mutex mtx_;
 
+    // raw storage, data_ is constructed by alloc()
+    static node* make_node() {
+        return static_cast<node*>(::operator new(sizeof(node), std::align_val_t { alignof(node) }));
+    }
+
+    static void drop_node(node* p) {
+        ::operator delete(p, std::align_val_t { alignof(node) });
+    }
+
 public:
     ~pool() {
         while (cursor_ != nullptr) {
             auto temp = cursor_->next_;
-            delete cursor_;
+            drop_node(cursor_);
             cursor_ = temp;
         }
     }
@@ -31,14 +60,28 @@ public:
         return cursor_ == nullptr;
     }
 
+    // Puts n free nodes in the pool up front, so the first n allocs don't hit the heap.
+    void reserve(std::size_t n) {
+        for (; n > 0; --n) {
+            auto temp = make_node();
+            auto guard = std::unique_lock { mtx_ };
+            temp->next_ = cursor_;
+            cursor_ = temp;
+        }
+    }
+
     template <typename... P>
     T* alloc(P&&... pars) {
-        auto guard = std::unique_lock { mtx_ };
-        if (cursor_ == nullptr) {
-            return &((new node { std::forward<P>(pars)... })->data_);
+        void* p;
+        {
+            auto guard = std::unique_lock { mtx_ };
+            if (cursor_ != nullptr) {
+                p = &(cursor_->data_);
+                cursor_ = cursor_->next_;
+            }
+            else p = nullptr;
         }
-        void* p = &(cursor_->data_);
-        cursor_ = cursor_->next_;
+        if (p == nullptr) p = &(make_node()->data_);
         return ::new (p) T { std::forward<P>(pars)... };
     }
 
@@ -55,23 +98,72 @@ template <typename T>
 class queue {
     struct node {
         T      data_;
-        node * next_;
+        node * next_ = nullptr;
+
+        template <typename... P>
+        node(P&&... pars)
+            : data_(detail::make<T>(std::forward<P>(pars)...))
+        {}
     } * head_ = nullptr,
       * tail_ = nullptr;
 
     pool<node> allocator_;
     mutable std::mutex mtx_;
 
+    std::size_t const        cap_  = 0; // 0: no limit
+    std::atomic<std::size_t> live_ { 0 };
+
+    bool count_push() {
+        if (cap_ == 0) return true;
+        if (live_.fetch_add(1, std::memory_order_relaxed) < cap_) return true;
+        live_.fetch_sub(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    void count_pop() {
+        if (cap_ != 0) live_.fetch_sub(1, std::memory_order_relaxed);
+    }
+
 public:
+    using value_type = T;
+
+    queue() = default;
+
+    /*
+     * Pre-allocates reserve_n nodes.
+     * With a non-zero cap, pushes fail while cap elements are in the queue.
+    */
+    explicit queue(std::size_t reserve_n, std::size_t cap = 0)
+        : cap_(cap) {
+        reserve(reserve_n);
+    }
+
+    ~queue() {
+        while (head_ != nullptr) {
+            auto temp = head_;
+            head_ = head_->next_;
+            temp->~node();
+            allocator_.free(temp);
+        }
+    }
+
     void quit() {}
 
+    void reserve(std::size_t n) {
+        allocator_.reserve(n);
+    }
+
     bool empty() const {
         auto guard = std::unique_lock { mtx_ };
         return head_ == nullptr;
     }
 
-    bool push(T const & val) {
-        auto p = allocator_.alloc(val, nullptr);
+    template <typename... P>
+    bool emplace(P&&... pars) {
+        if (!count_push()) {
+            return false;
+        }
+        auto p = allocator_.alloc(std::forward<P>(pars)...);
         auto guard = std::unique_lock { mtx_ };
         if (tail_ == nullptr) {
             head_ = tail_ = p;
@@ -83,20 +175,42 @@ public:
         return true;
     }
 
-    std::tuple<T, bool> pop() {
-        std::unique_ptr<node, std::function<void(node*)>> temp;
-        auto guard = std::unique_lock { mtx_ };
-        if (head_ == nullptr) {
-            return {};
-        }
-        auto ret  = std::make_tuple(head_->data_, true);
-        temp = decltype(temp) {
-            head_, [this](node* temp) { allocator_.free(temp); }
-        };
-        head_ = head_->next_;
-        if (tail_ == temp.get()) {
-            tail_ = nullptr;
+    bool push(T const & val) {
+        return emplace(val);
+    }
+
+    bool push(T&& val) {
+        return emplace(std::move(val));
+    }
+
+    bool pop(T& val) {
+        node* temp;
+        {
+            auto guard = std::unique_lock { mtx_ };
+            if (head_ == nullptr) {
+                return false;
+            }
+            temp = head_;
+            head_ = head_->next_;
+            if (tail_ == temp) {
+                tail_ = nullptr;
+            }
         }
+        // the node is no longer reachable, so it can be drained outside the lock
+        val = std::move(temp->data_);
+        temp->~node();
+        allocator_.free(temp);
+        count_pop();
+        return true;
+    }
+
+    bool try_pop(T& val) {
+        return pop(val);
+    }
+
+    std::tuple<T, bool> pop() {
+        std::tuple<T, bool> ret {};
+        std::get<1>(ret) = pop(std::get<0>(ret));
         return ret;
     }
 };
@@ -7,8 +7,17 @@
 #include <cstdint>
 #include <thread>
 #include <limits>
+#include <algorithm>
+#include <mutex>
+#include <vector>
+#include <unordered_set>
+#include <memory>
 
 #include "queue_spsc.h"
+#include "queue_wait.h"
+#include "queue_reclaim.h"
+#include "queue_stats.h"
+#include "queue_thread.h"
 
 namespace mpmc {
 namespace detail {
@@ -146,28 +155,154 @@ public:
     }
 };
 
-template <typename T>
-class pool {
+namespace detail {
+
+// A 32-bit index and a 32-bit tag, the value type of mpmc::tagged_index.
+class tagged_index {
+
+    std::uint64_t data_ { nil };
+
+public:
+    enum : std::uint32_t {
+        nil = 0xffffffffu // no index
+    };
+
+    tagged_index() = default;
+
+    explicit tagged_index(std::uint64_t num)
+        : data_(num)
+    {}
+
+    tagged_index(std::uint32_t idx, std::uint32_t tag)
+        : data_((static_cast<std::uint64_t>(tag) << 32) | idx)
+    {}
+
+    friend bool operator==(tagged_index a, tagged_index b) { return a.data_ == b.data_; }
+    friend bool operator!=(tagged_index a, tagged_index b) { return !(a == b); }
+
+    std::uint64_t data() const {
+        return data_;
+    }
+
+    std::uint32_t index() const {
+        return static_cast<std::uint32_t>(data_);
+    }
+
+    std::uint32_t tag() const {
+        return static_cast<std::uint32_t>(data_ >> 32);
+    }
+};
+
+} // namespace detail
+
+/*
+ * tagged for nodes that live in an array (see arena_pool):
+ * a 32-bit index instead of a 48-bit pointer, so the tag gets 32 bits and wraps after 4G updates
+ * instead of 64K, and nothing depends on the width of virtual addresses.
+ * Every store and successful CAS bumps the tag.
+*/
+class tagged_index {
+public:
+    using dt_t = detail::tagged_index;
+
+    enum : std::uint32_t {
+        nil = dt_t::nil
+    };
+
+private:
+    std::atomic<std::uint64_t> data_ { dt_t {}.data() };
+
+public:
+    tagged_index() = default;
+
+    explicit tagged_index(std::uint32_t idx)
+        : data_(dt_t { idx, 0 }.data())
+    {}
+
+    std::uint32_t load(std::memory_order order) const {
+        return dt_t { data_.load(order) }.index();
+    }
+
+    dt_t tag_load(std::memory_order order) const {
+        return dt_t { data_.load(order) };
+    }
+
+    void store(std::uint32_t idx, std::memory_order order) {
+        auto old = tag_load(std::memory_order_relaxed);
+        while (!compare_exchange_weak(old, idx, order)) ;
+    }
+
+    bool compare_exchange_weak(dt_t& exp, std::uint32_t idx, std::memory_order order) {
+        auto num = exp.data();
+        bool ret = data_.compare_exchange_weak(num, dt_t { idx, exp.tag() + 1 }.data(), order);
+        exp = dt_t { num };
+        return ret;
+    }
+
+    bool compare_exchange_strong(dt_t& exp, std::uint32_t idx, std::memory_order order) {
+        auto num = exp.data();
+        bool ret = data_.compare_exchange_strong(num, dt_t { idx, exp.tag() + 1 }.data(), order);
+        exp = dt_t { num };
+        return ret;
+    }
+};
 
+/*
+ * One heap allocation per node, every free node sits on a single shared list.
+ * Slower than pool under contention, but each node can be deleted on its own.
+*/
+template <typename T>
+class list_pool {
+protected:
     union node {
         T data_;
         tagged<node*> next_;
 
-        template <typename... P>
-        node(P&&... pars)
-            : data_ { std::forward<P>(pars)... }
-        {}
+        ~node() {}
     };
 
-    tagged     <node*> cursor_ { nullptr };
-    std::atomic<node*> el_     { nullptr };
+    tagged     <node*>       cursor_ { nullptr };
+    std::atomic<node*>       el_     { nullptr };
+    std::atomic<std::size_t> heap_   { 0 };       // nodes taken from the heap and not given back
+
+    // raw storage, data_ is constructed by alloc()
+    node* make_node() {
+        heap_.fetch_add(1, std::memory_order_relaxed);
+        return static_cast<node*>(::operator new(sizeof(node), std::align_val_t { alignof(node) }));
+    }
+
+    void drop_node(node* p) {
+        heap_.fetch_sub(1, std::memory_order_relaxed);
+        ::operator delete(p, std::align_val_t { alignof(node) });
+    }
+
+    void push_free(node* temp) {
+        auto curr = cursor_.tag_load(std::memory_order_relaxed);
+        while (1) {
+            temp->next_.store(curr.ptr(), std::memory_order_relaxed);
+            if (cursor_.compare_exchange_weak(curr, temp, std::memory_order_release)) {
+                break;
+            }
+        }
+    }
 
 public:
-    ~pool() {
+    struct guard_t {};
+
+    /*
+     * Nodes are never given back to the system while the pool lives,
+     * so reading a node that has already been freed is harmless and no guard is needed.
+    */
+    guard_t guard() const noexcept {
+        return {};
+    }
+
+    ~list_pool() {
+        if (auto p = el_.load(std::memory_order_relaxed)) drop_node(p);
         auto curr = cursor_.load(std::memory_order_relaxed);
         while (curr != nullptr) {
             auto temp = curr->next_.load(std::memory_order_relaxed);
-            delete curr;
+            drop_node(curr);
             curr = temp;
         }
     }
@@ -176,6 +311,16 @@ public:
         return cursor_.load(std::memory_order_acquire) == nullptr;
     }
 
+    // Nodes held from the heap: in use, free, or waiting to be reclaimed.
+    std::size_t heap_nodes() const {
+        return heap_.load(std::memory_order_relaxed);
+    }
+
+    // Puts n free nodes in the pool up front, so the first n allocs don't hit the heap.
+    void reserve(std::size_t n) {
+        for (; n > 0; --n) push_free(make_node());
+    }
+
     template <typename... P>
     T* alloc(P&&... pars) {
         typename tagged<node*>::dt_t curr = el_.exchange(nullptr, std::memory_order_relaxed);
@@ -183,7 +328,7 @@ public:
             curr = cursor_.tag_load(std::memory_order_acquire);
             while (1) {
                 if (curr.ptr() == nullptr) {
-                    return &((new node { std::forward<P>(pars)... })->data_);
+                    return ::new (&(make_node()->data_)) T { std::forward<P>(pars)... };
                 }
                 auto next = curr->next_.load(std::memory_order_relaxed);
                 if (cursor_.compare_exchange_weak(curr, next, std::memory_order_acquire)) {
@@ -198,390 +343,2251 @@ public:
         if (p == nullptr) return;
         auto temp = reinterpret_cast<node*>(p);
         temp = el_.exchange(temp, std::memory_order_relaxed);
-        if (temp == nullptr) {
-            return;
-        }
-        auto curr = cursor_.tag_load(std::memory_order_relaxed);
-        while (1) {
-            temp->next_.store(curr.ptr(), std::memory_order_relaxed);
-            if (cursor_.compare_exchange_weak(curr, temp, std::memory_order_release)) {
-                break;
-            }
+        if (temp != nullptr) {
+            push_free(temp);
         }
     }
 };
 
-template <typename T>
-class queue {
+/*
+ * Magazine allocator.
+ *
+ * Each thread works on its own magazine, a padded slot picked by thread_id::get(),
+ * holding up to two chains of magazine_size free nodes (Bonwick's loaded and previous magazines).
+ * Only a full chain goes to the depot, and only a full chain comes back from it,
+ * so producers that keep allocating and consumers that keep freeing trade nodes
+ * with one CAS per magazine_size nodes.
+ * New nodes are carved from cache-aligned slabs, which are released by the destructor.
+ *
+ * A thread that finds its magazine taken by another thread with the same slot
+ * falls back to a shared list of single nodes.
+*/
+template <typename T, typename Stats = stats::none>
+class pool : protected stats::inner<Stats> {
 
-    struct node {
+    union node {
         T data_;
-        tagged<node*> next_;
+        struct {
+            tagged<node*> next_;  // link in the depot and the shared list
+            node*         chain_; // link inside a chain
+        } free_;
+
+        ~node() {}
     };
 
-    pool<node> allocator_;
+    enum : unsigned {
+        magazine_size  = 64,
+        magazine_count = 32
+    };
 
-    tagged<node*> head_ { allocator_.alloc() };
-    tagged<node*> tail_ { head_.load(std::memory_order_relaxed) };
+    struct alignas(spsc::cache_line_size) magazine {
+        std::atomic<bool> busy_ { false };
+        node*    loaded_ = nullptr;
+        node*    prev_   = nullptr; // a full chain or nothing
+        unsigned count_  = 0;       // nodes in loaded_
 
-public:
-    void quit() {}
+        bool try_lock() {
+            return !busy_.load(std::memory_order_relaxed) &&
+                   !busy_.exchange(true, std::memory_order_acquire);
+        }
 
-    bool empty() const {
-        return head_.load(std::memory_order_acquire)
-             ->next_.load(std::memory_order_relaxed) == nullptr;
-    }
+        void unlock() {
+            busy_.store(false, std::memory_order_release);
+        }
+    };
 
-    bool push_v1(T const & val) {
-        auto p = allocator_.alloc(val, nullptr);
+    magazine mags_[magazine_count];
+
+    alignas(spsc::cache_line_size) tagged<node*> depot_  { nullptr }; // full chains
+    alignas(spsc::cache_line_size) tagged<node*> shared_ { nullptr }; // single nodes
+    std::atomic<node*> slabs_ { nullptr };
+
+    void push(tagged<node*>& list, node* first, node* last) {
+        auto curr = list.tag_load(std::memory_order_relaxed);
         while (1) {
-            auto tail = tail_.tag_load(std::memory_order_relaxed);
-            auto next = tail->next_.tag_load(std::memory_order_acquire);
-            if (next.ptr() == nullptr &&
-                tail->next_.compare_exchange_weak(next, p, std::memory_order_relaxed)) {
-                tail_.compare_exchange_strong(tail, p, std::memory_order_release);
-                return true;
+            last->free_.next_.store(curr.ptr(), std::memory_order_relaxed);
+            if (list.compare_exchange_weak(curr, first, std::memory_order_release)) {
+                return;
             }
+            this->record(stats::event::cas_retry);
         }
     }
 
-    bool push_v2(T const & val) {
-        auto p = allocator_.alloc(val, nullptr);
-        auto tail = tail_.tag_load(std::memory_order_relaxed);
-        while (1) {
-            auto next = tail->next_.tag_load(std::memory_order_acquire);
-            if (next.ptr() == nullptr) {
-                if (tail->next_.compare_exchange_weak(next, p, std::memory_order_relaxed)) {
-                    tail_.compare_exchange_strong(tail, p, std::memory_order_release);
-                    return true;
-                }
-            }
-            else if (!tail_.compare_exchange_weak(tail, next.ptr(), std::memory_order_relaxed)) {
-                continue;
+    node* pop(tagged<node*>& list) {
+        auto curr = list.tag_load(std::memory_order_acquire);
+        while (curr.ptr() != nullptr) {
+            auto next = curr->free_.next_.load(std::memory_order_relaxed);
+            if (list.compare_exchange_weak(curr, next, std::memory_order_acquire)) {
+                break;
             }
-            tail = tail_.tag_load(std::memory_order_relaxed);
+            this->record(stats::event::cas_retry);
         }
+        return curr.ptr();
     }
 
-    bool push_v3(T const & val) {
-        auto p = allocator_.alloc(val, nullptr);
-        tail_.exchange(p, std::memory_order_relaxed)
-         ->next_.store(p, std::memory_order_release);
-        return true;
+    /*
+     * Returns magazine_size fresh nodes linked by chain_.
+     * The first node of a slab only links it into slabs_.
+    */
+    node* make_slab() {
+        this->record(stats::event::pool_heap);
+        auto slab = static_cast<node*>(::operator new(sizeof(node) * (magazine_size + 1),
+                                                      std::align_val_t { spsc::cache_line_size }));
+        slab->free_.chain_ = slabs_.load(std::memory_order_relaxed);
+        while (!slabs_.compare_exchange_weak(slab->free_.chain_, slab, std::memory_order_release)) ;
+        for (unsigned i = 1; i < magazine_size; ++i) {
+            slab[i].free_.chain_ = &slab[i + 1];
+        }
+        slab[magazine_size].free_.chain_ = nullptr;
+        return &slab[1];
     }
 
-    std::tuple<T, bool> pop_v1() {
-        auto head = head_.tag_load(std::memory_order_acquire);
-        while (1) {
-            auto next = head->next_.load(std::memory_order_acquire);
-            if (next == nullptr) {
-                return {};
+    node* alloc_node(magazine& m) {
+        if (m.count_ == 0) {
+            if (m.prev_ != nullptr) {
+                m.loaded_ = m.prev_;
+                m.prev_   = nullptr;
             }
-            auto ret = std::make_tuple(next->data_, true);
-            if (head_.compare_exchange_weak(head, next, std::memory_order_acquire)) {
-                allocator_.free(head.ptr());
-                return ret;
+            else if ((m.loaded_ = pop(depot_)) == nullptr) {
+                // reuse what threads without a magazine have freed before growing
+                if (auto p = pop(shared_)) return p;
+                m.loaded_ = make_slab();
             }
+            m.count_ = magazine_size;
         }
+        auto p = m.loaded_;
+        m.loaded_ = p->free_.chain_;
+        --m.count_;
+        return p;
     }
 
-    std::tuple<T, bool> pop_v2() {
-        auto head = head_.tag_load(std::memory_order_relaxed);
-        auto tail = tail_.tag_load(std::memory_order_relaxed);
-        while (1) {
-            auto next = head->next_.load(std::memory_order_acquire);
-            if (next == nullptr) {
-                return {};
-            }
-            if (head.ptr() == tail.ptr()) {
-                if (!tail_.compare_exchange_weak(tail, next, std::memory_order_relaxed)) {
-                    head = head_.tag_load(std::memory_order_relaxed);
-                    continue;
-                }
+    void free_node(magazine& m, node* p) {
+        if (m.count_ == magazine_size) {
+            if (m.prev_ != nullptr) {
+                push(depot_, m.prev_, m.prev_);
             }
-            else {
-                auto ret = std::make_tuple(next->data_, true);
-                if (head_.compare_exchange_weak(head, next, std::memory_order_acquire)) {
-                    allocator_.free(head.ptr());
-                    return ret;
-                }
-                tail = tail_.tag_load(std::memory_order_acquire);
-                continue;
+            m.prev_   = m.loaded_;
+            m.loaded_ = nullptr;
+            m.count_  = 0;
+        }
+        p->free_.chain_ = m.loaded_;
+        m.loaded_ = p;
+        ++m.count_;
+    }
+
+    node* alloc_shared() {
+        auto p = pop(shared_);
+        if (p == nullptr) {
+            p = make_slab();
+            auto last = p->free_.chain_;
+            for (auto q = last; q != nullptr; q = q->free_.chain_) {
+                q->free_.next_.store(q->free_.chain_, std::memory_order_relaxed);
+                last = q;
             }
-            head = head_.tag_load(std::memory_order_relaxed);
-            tail = tail_.tag_load(std::memory_order_relaxed);
+            push(shared_, p->free_.chain_, last);
         }
+        return p;
+    }
+
+    magazine& this_magazine() {
+        return mags_[thread_id::get() % magazine_count];
     }
 
+public:
+    struct guard_t {};
+
+    using stats::inner<Stats>::stats;
+
     /*
-     * Simple, Fast, and Practical Non-Blocking and Blocking Concurrent Queue Algorithms
-     *  - Maged M. Michael, Michael L. Scott
-     * http://www.cs.rochester.edu/~scott/papers/1996_PODC_queues.pdf
+     * Nodes are never given back to the system while the pool lives,
+     * so reading a node that has already been freed is harmless and no guard is needed.
     */
+    guard_t guard() const noexcept {
+        return {};
+    }
 
-    bool push(T const & val) {
-        auto p = allocator_.alloc(val, nullptr);
-        auto tail = tail_.tag_load(std::memory_order_relaxed);
-        while (1) {
-            auto next = tail->next_.tag_load(std::memory_order_acquire);
-            if (tail == tail_.tag_load(std::memory_order_relaxed)) {
-                if (next.ptr() == nullptr) {
-                    if (tail->next_.compare_exchange_weak(next, p, std::memory_order_relaxed)) {
-                        tail_.compare_exchange_strong(tail, p, std::memory_order_release);
-                        break;
-                    }
-                }
-                else if (!tail_.compare_exchange_weak(tail, next.ptr(), std::memory_order_relaxed)) {
-                    continue;
-                }
-            }
-            tail = tail_.tag_load(std::memory_order_relaxed);
+    pool() = default;
+    pool(pool const &) = delete;
+    pool& operator=(pool const &) = delete;
+
+    ~pool() {
+        auto slab = slabs_.load(std::memory_order_acquire);
+        while (slab != nullptr) {
+            auto temp = slab->free_.chain_;
+            ::operator delete(slab, std::align_val_t { spsc::cache_line_size });
+            slab = temp;
         }
-        return true;
     }
 
-    std::tuple<T, bool> pop() {
-        auto head = head_.tag_load(std::memory_order_acquire);
-        auto tail = tail_.tag_load(std::memory_order_acquire);
-        while (1) {
-            auto next = head->next_.load(std::memory_order_acquire);
-            if (head == head_.tag_load(std::memory_order_relaxed)) {
-                if (head.ptr() == tail.ptr()) {
-                    if (next == nullptr) {
-                        return {};
-                    }
-                    tail_.compare_exchange_weak(tail, next, std::memory_order_relaxed);
-                }
-                else {
-                    auto ret = std::make_tuple(next->data_, true);
-                    if (head_.compare_exchange_weak(head, next, std::memory_order_acquire)) {
-                        allocator_.free(head.ptr());
-                        return ret;
-                    }
-                    tail = tail_.tag_load(std::memory_order_acquire);
-                    continue;
-                }
-            }
-            head = head_.tag_load(std::memory_order_acquire);
-            tail = tail_.tag_load(std::memory_order_acquire);
+    // Puts at least n free nodes in the depot up front, in whole slabs.
+    void reserve(std::size_t n) {
+        for (std::size_t k = 0; k < n; k += magazine_size) {
+            auto chain = make_slab();
+            push(depot_, chain, chain);
         }
     }
-};
 
-} // namespace mpmc
+    template <typename... P>
+    T* alloc(P&&... pars) {
+        node* p;
+        auto& m = this_magazine();
+        if (m.try_lock()) {
+            p = alloc_node(m);
+            m.unlock();
+        }
+        else p = alloc_shared();
+        this->record(stats::event::pool_alloc);
+        return ::new (&(p->data_)) T { std::forward<P>(pars)... };
+    }
 
-namespace spmc {
+    void free(void* p) {
+        if (p == nullptr) return;
+        this->record(stats::event::pool_free);
+        auto temp = reinterpret_cast<node*>(p);
+        auto& m = this_magazine();
+        if (m.try_lock()) {
+            free_node(m, temp);
+            m.unlock();
+        }
+        else push(shared_, temp, temp);
+    }
+};
 
+/*
+ * A pool that can give its free nodes back to the system.
+ *
+ * shrink() detaches the free list and retires it to reclaim::domain,
+ * the nodes are deleted once no thread is inside a guard() that might still read them.
+ * Users must hold a guard() while they may touch a node that another thread has freed.
+*/
 template <typename T>
-class qring : public spsc::qring<T> {
-protected:
-    using spsc::qring<T>::rd_;
-    using spsc::qring<T>::wt_;
-    using spsc::qring<T>::block_;
-    using spsc::qring<T>::index_of;
+class epoch_pool : public list_pool<T> {
+    using base_t = list_pool<T>;
+    using node   = typename base_t::node;
+
+    static void destroy(void* owner, void* p) {
+        auto self = static_cast<epoch_pool*>(owner);
+        auto curr = static_cast<node*>(p);
+        while (curr != nullptr) {
+            auto temp = curr->next_.load(std::memory_order_relaxed);
+            self->drop_node(curr);
+            curr = temp;
+        }
+    }
 
 public:
+    ~epoch_pool() {
+        reclaim::domain::instance().drain(this);
+    }
+
+    reclaim::guard guard() const {
+        return {};
+    }
+
+    template <typename... P>
+    T* alloc(P&&... pars) {
+        reclaim::guard g;
+        return base_t::alloc(std::forward<P>(pars)...);
+    }
+
     /*
-     * Yet another implementation of a lock-free circular array queue
-     *  - Faustino Frechilla
-     * https://www.codeproject.com/Articles/153898/Yet-another-implementation-of-a-lock-free-circular
+     * Returns every node cached by the pool to the system.
+     * Waits out the grace period, so the nodes are gone when it returns,
+     * unless the calling thread is inside a guard: then they go at a later collect().
     */
-    std::tuple<T, bool> pop() {
-        auto cur_rd = rd_.load(std::memory_order_relaxed);
-        while (1) {
-            auto id_rd = index_of(cur_rd);
-            if (id_rd == index_of(wt_.load(std::memory_order_acquire))) {
-                return {}; // empty
-            }
-            auto ret = std::make_tuple(block_[id_rd], true);
-            if (rd_.compare_exchange_weak(cur_rd, cur_rd + 1, std::memory_order_release)) {
-                return ret;
-            }
+    void shrink() {
+        auto list = this->cursor_.exchange(nullptr, std::memory_order_acquire).ptr();
+        auto el   = this->el_.exchange(nullptr, std::memory_order_acquire);
+        if (el != nullptr) {
+            el->next_.store(list, std::memory_order_relaxed);
+            list = el;
+        }
+        auto& dom = reclaim::domain::instance();
+        if (list != nullptr) {
+            dom.retire(this, list, &destroy);
         }
+        dom.synchronize(this);
     }
 };
 
-} // namespace spmc
+/*
+ * A pool whose nodes sit in cache-aligned chunks and are handed out by 32-bit index.
+ *
+ * Chunk k holds first << k nodes, so an index splits into a chunk and an offset with one bit scan,
+ * and a few dozen chunks cover every index below nil. The pool starts with one chunk and adds
+ * the next one when the free list runs dry, chunks live as long as the pool does.
+ * A free node is linked through its own T::next_ (a tagged_index), so the free list costs no room.
+ * alloc() returns nil only when the next chunk would reach nil.
+*/
+template <typename T, typename Stats = stats::none>
+class arena_pool : protected stats::inner<Stats> {
+    static_assert(std::is_same<decltype(T::next_), tagged_index>::value, "Free nodes are linked through T::next_.");
 
-namespace mpmc {
+public:
+    enum : std::uint32_t {
+        nil = tagged_index::nil
+    };
 
-template <typename T>
-class qlock : public spmc::qring<T> {
-    using base_t = spmc::qring<T>;
+private:
+    enum : unsigned {
+        chunk_max = 32
+    };
 
-protected:
-    using typename base_t::ti_t;
+    unsigned const             bits_;                // log2 of the size of chunk 0
+    std::atomic<T*>            chunks_[chunk_max] {};
+    std::atomic<unsigned>      count_ { 0 };         // chunks built
+    std::mutex                 grow_;
+
+    alignas(spsc::cache_line_size) tagged_index free_;
+
+    static unsigned floor_log2(std::uint64_t v) noexcept {
+#if defined(__GNUC__)
+        return 63u - static_cast<unsigned>(__builtin_clzll(v));
+#else
+        unsigned r = 0;
+        while (v >>= 1) ++r;
+        return r;
+#endif
+    }
+
+    // Chunk k covers [(1 << (bits_ + k)) - (1 << bits_), (1 << (bits_ + k + 1)) - (1 << bits_)).
+    std::uint64_t chunk_begin(unsigned k) const noexcept {
+        return (std::uint64_t(1) << (bits_ + k)) - (std::uint64_t(1) << bits_);
+    }
+
+    std::uint64_t chunk_end(unsigned k) const noexcept {
+        return chunk_begin(k + 1);
+    }
+
+    T& at(std::uint32_t idx) const noexcept {
+        auto v  = std::uint64_t(idx) + (std::uint64_t(1) << bits_);
+        auto hi = floor_log2(v);
+        return chunks_[hi - bits_].load(std::memory_order_acquire)[v - (std::uint64_t(1) << hi)];
+    }
+
+    // Links the free nodes [first, last] in front of the free list.
+    void push_free(std::uint32_t first, std::uint32_t last) {
+        auto curr = free_.tag_load(std::memory_order_relaxed);
+        while (1) {
+            at(last).next_.store(curr.index(), std::memory_order_relaxed);
+            if (free_.compare_exchange_weak(curr, first, std::memory_order_release)) {
+                return;
+            }
+            this->record(stats::event::cas_retry);
+        }
+    }
+
+    /*
+     * Builds the next chunk and hands its nodes to the free list.
+     * Returns false when there is no room for it below nil.
+     * One thread grows at a time, a thread that waited for it finds the nodes it added.
+    */
+    bool grow() {
+        auto guard = std::unique_lock { grow_ };
+        if (free_.load(std::memory_order_acquire) != nil) {
+            return true;
+        }
+        auto k = count_.load(std::memory_order_relaxed);
+        if ((k == chunk_max) || (chunk_end(k) > nil)) {
+            return false;
+        }
+        auto beg = chunk_begin(k), end = chunk_end(k);
+        auto n   = static_cast<std::size_t>(end - beg);
+        auto p   = static_cast<T*>(::operator new(sizeof(T) * n, std::align_val_t { spsc::cache_line_size }));
+        this->record(stats::event::pool_heap);
+        for (std::size_t i = 0; i < n; ++i) {
+            ::new (&p[i]) T;
+            p[i].next_.store(static_cast<std::uint32_t>(beg + i + 1), std::memory_order_relaxed);
+        }
+        chunks_[k].store(p, std::memory_order_release);
+        count_.store(k + 1, std::memory_order_release);
+        push_free(static_cast<std::uint32_t>(beg), static_cast<std::uint32_t>(end - 1));
+        return true;
+    }
+
+public:
+    using stats::inner<Stats>::stats;
+
+    // n nodes up front, rounded up to a power of two: the size of chunk 0.
+    explicit arena_pool(std::size_t n)
+        : bits_(floor_log2(spsc::detail::ceil_pow2((std::max)(std::size_t(1), (std::min)(n, std::size_t(1) << 30))))) {
+        grow();
+    }
+
+    arena_pool(arena_pool const &) = delete;
+    arena_pool& operator=(arena_pool const &) = delete;
+
+    ~arena_pool() {
+        auto count = count_.load(std::memory_order_relaxed);
+        for (unsigned k = 0; k < count; ++k) {
+            auto p = chunks_[k].load(std::memory_order_relaxed);
+            auto n = static_cast<std::size_t>(chunk_end(k) - chunk_begin(k));
+            for (std::size_t i = 0; i < n; ++i) p[i].~T();
+            ::operator delete(p, std::align_val_t { spsc::cache_line_size });
+        }
+    }
+
+    // The nodes built so far, taken or free.
+    std::size_t capacity() const noexcept {
+        return static_cast<std::size_t>(chunk_begin(count_.load(std::memory_order_acquire)));
+    }
+
+    T&       operator[](std::uint32_t idx)       noexcept { return at(idx); }
+    T const& operator[](std::uint32_t idx) const noexcept { return at(idx); }
+
+    std::uint32_t alloc() {
+        auto curr = free_.tag_load(std::memory_order_acquire);
+        while (1) {
+            if (curr.index() == nil) {
+                if (!grow()) return nil;
+                curr = free_.tag_load(std::memory_order_acquire);
+                continue;
+            }
+            // a stale link is harmless, the tag makes the CAS fail
+            auto next = at(curr.index()).next_.load(std::memory_order_relaxed);
+            if (free_.compare_exchange_weak(curr, next, std::memory_order_acquire)) {
+                this->record(stats::event::pool_alloc);
+                return curr.index();
+            }
+            this->record(stats::event::cas_retry);
+        }
+    }
+
+    void free(std::uint32_t idx) {
+        if (idx == nil) return;
+        this->record(stats::event::pool_free);
+        push_free(idx, idx);
+    }
+};
+
+/*
+ * Pool decides how nodes are recycled:
+ * pool and list_pool keep them until the queue dies, epoch_pool can also shrink().
+ *
+ * With a Stats policy other than stats::none, the queue counts its live elements even without a cap,
+ * and stats() includes the counters of a pool that has its own (e.g. pool<T, stats::counters>).
+*/
+template <typename T, template <typename> class Pool = pool, typename Stats = stats::none>
+class queue : protected Stats {
+
+    struct node {
+        T data_;
+        tagged<node*> next_ { nullptr };
+
+        /*
+         * A node goes back to the pool after two releases:
+         * one by the consumer that moved data_ out of it,
+         * one by the consumer that unlinked it from the head.
+        */
+        std::atomic<unsigned> rel_ { 0 };
+
+        template <typename... P>
+        node(P&&... pars)
+            : data_(spsc::detail::make<T>(std::forward<P>(pars)...))
+        {}
+    };
+
+    Pool<node> allocator_;
+
+    tagged<node*> head_ { make_dummy() };
+    tagged<node*> tail_ { head_.load(std::memory_order_relaxed) };
+
+    node* make_dummy() {
+        auto p = allocator_.alloc();
+        p->rel_.store(1, std::memory_order_relaxed); // has no data to take
+        return p;
+    }
+
+    void release(node* p) {
+        if (p->rel_.fetch_add(1, std::memory_order_acq_rel) == 1) {
+            p->~node();
+            allocator_.free(p);
+        }
+    }
+
+    // The count of live elements, on a cache line of its own.
+    struct alignas(spsc::cache_line_size) live_count {
+        std::atomic<std::size_t> n_ { 0 };
+    };
+
+    std::size_t const cap_ = 0; // 0: no limit
+
+    // Only allocated when something reads it (a cap or a Stats policy), so a plain queue pays one pointer.
+    std::unique_ptr<live_count> live_ { Stats::enabled ? new live_count : nullptr };
+
+    bool count_push() {
+        if (live_ == nullptr) return true;
+        auto n = live_->n_.fetch_add(1, std::memory_order_relaxed);
+        if ((cap_ != 0) && (n >= cap_)) {
+            live_->n_.fetch_sub(1, std::memory_order_relaxed);
+            this->record(stats::event::full);
+            return false;
+        }
+        this->record_depth(n + 1);
+        return true;
+    }
+
+    bool take(typename tagged<node*>::dt_t head, node* next, T& val) {
+        val = std::move(next->data_);
+        release(next);
+        release(head.ptr());
+        if (live_ != nullptr) live_->n_.fetch_sub(1, std::memory_order_relaxed);
+        return true;
+    }
+
+public:
+    using value_type = T;
+
+    stats::report stats() const {
+        auto ret = Stats::stats();
+        if constexpr (stats::has_stats<Pool<node>>::value) {
+            ret += allocator_.stats();
+        }
+        return ret;
+    }
+
+    queue() = default;
+
+    /*
+     * Pre-allocates reserve_n nodes.
+     * With a non-zero cap, pushes fail while cap elements are in the queue.
+    */
+    explicit queue(std::size_t reserve_n, std::size_t cap = 0)
+        : cap_(cap) {
+        if ((cap_ != 0) && (live_ == nullptr)) live_.reset(new live_count);
+        reserve(reserve_n);
+    }
+
+    ~queue() {
+        auto curr = head_.load(std::memory_order_relaxed);
+        while (curr != nullptr) {
+            auto temp = curr->next_.load(std::memory_order_relaxed);
+            curr->~node();
+            allocator_.free(curr);
+            curr = temp;
+        }
+    }
+
+    void quit() {}
+
+    void reserve(std::size_t n) {
+        allocator_.reserve(n);
+    }
+
+    // Gives the nodes cached after a burst back to the system, needs epoch_pool.
+    void shrink() {
+        allocator_.shrink();
+    }
+
+    bool empty() const {
+        [[maybe_unused]] auto g = allocator_.guard();
+        return head_.load(std::memory_order_acquire)
+             ->next_.load(std::memory_order_relaxed) == nullptr;
+    }
+
+    bool push_v1(T const & val) {
+        if (!count_push()) return false;
+        [[maybe_unused]] auto g = allocator_.guard();
+        auto p = allocator_.alloc(val);
+        while (1) {
+            auto tail = tail_.tag_load(std::memory_order_relaxed);
+            auto next = tail->next_.tag_load(std::memory_order_acquire);
+            if (next.ptr() == nullptr &&
+                tail->next_.compare_exchange_weak(next, p, std::memory_order_relaxed)) {
+                tail_.compare_exchange_strong(tail, p, std::memory_order_release);
+                return true;
+            }
+        }
+    }
+
+    bool push_v2(T const & val) {
+        if (!count_push()) return false;
+        [[maybe_unused]] auto g = allocator_.guard();
+        auto p = allocator_.alloc(val);
+        auto tail = tail_.tag_load(std::memory_order_relaxed);
+        while (1) {
+            auto next = tail->next_.tag_load(std::memory_order_acquire);
+            if (next.ptr() == nullptr) {
+                if (tail->next_.compare_exchange_weak(next, p, std::memory_order_relaxed)) {
+                    tail_.compare_exchange_strong(tail, p, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (!tail_.compare_exchange_weak(tail, next.ptr(), std::memory_order_relaxed)) {
+                continue;
+            }
+            tail = tail_.tag_load(std::memory_order_relaxed);
+        }
+    }
+
+    bool push_v3(T const & val) {
+        if (!count_push()) return false;
+        auto p = allocator_.alloc(val);
+        tail_.exchange(p, std::memory_order_relaxed)
+         ->next_.store(p, std::memory_order_release);
+        return true;
+    }
+
+    bool pop_v1(T& val) {
+        [[maybe_unused]] auto g = allocator_.guard();
+        auto head = head_.tag_load(std::memory_order_acquire);
+        while (1) {
+            auto next = head->next_.load(std::memory_order_acquire);
+            if (next == nullptr) {
+                this->record(stats::event::empty);
+                return false;
+            }
+            if (head_.compare_exchange_weak(head, next, std::memory_order_acquire)) {
+                return take(head, next, val);
+            }
+        }
+    }
+
+    bool pop_v2(T& val) {
+        [[maybe_unused]] auto g = allocator_.guard();
+        auto head = head_.tag_load(std::memory_order_relaxed);
+        auto tail = tail_.tag_load(std::memory_order_relaxed);
+        while (1) {
+            auto next = head->next_.load(std::memory_order_acquire);
+            if (next == nullptr) {
+                this->record(stats::event::empty);
+                return false;
+            }
+            if (head.ptr() == tail.ptr()) {
+                if (!tail_.compare_exchange_weak(tail, next, std::memory_order_relaxed)) {
+                    head = head_.tag_load(std::memory_order_relaxed);
+                    continue;
+                }
+            }
+            else {
+                if (head_.compare_exchange_weak(head, next, std::memory_order_acquire)) {
+                    return take(head, next, val);
+                }
+                tail = tail_.tag_load(std::memory_order_acquire);
+                continue;
+            }
+            head = head_.tag_load(std::memory_order_relaxed);
+            tail = tail_.tag_load(std::memory_order_relaxed);
+        }
+    }
+
+    /*
+     * Simple, Fast, and Practical Non-Blocking and Blocking Concurrent Queue Algorithms
+     *  - Maged M. Michael, Michael L. Scott
+     * http://www.cs.rochester.edu/~scott/papers/1996_PODC_queues.pdf
+    */
+
+    template <typename... P>
+    bool emplace(P&&... pars) {
+        if (!count_push()) {
+            return false;
+        }
+        [[maybe_unused]] auto g = allocator_.guard();
+        auto p = allocator_.alloc(std::forward<P>(pars)...);
+        auto tail = tail_.tag_load(std::memory_order_relaxed);
+        while (1) {
+            auto next = tail->next_.tag_load(std::memory_order_acquire);
+            if (tail == tail_.tag_load(std::memory_order_relaxed)) {
+                if (next.ptr() == nullptr) {
+                    if (tail->next_.compare_exchange_weak(next, p, std::memory_order_relaxed)) {
+                        tail_.compare_exchange_strong(tail, p, std::memory_order_release);
+                        break;
+                    }
+                    this->record(stats::event::cas_retry);
+                }
+                else if (!tail_.compare_exchange_weak(tail, next.ptr(), std::memory_order_relaxed)) {
+                    continue;
+                }
+            }
+            tail = tail_.tag_load(std::memory_order_relaxed);
+        }
+        return true;
+    }
+
+    bool push(T const & val) {
+        return emplace(val);
+    }
+
+    bool push(T&& val) {
+        return emplace(std::move(val));
+    }
+
+    /*
+     * The data is moved out after the CAS on head_ has been won,
+     * so a failed attempt never touches it.
+    */
+    bool pop(T& val) {
+        [[maybe_unused]] auto g = allocator_.guard();
+        auto head = head_.tag_load(std::memory_order_acquire);
+        auto tail = tail_.tag_load(std::memory_order_acquire);
+        while (1) {
+            auto next = head->next_.load(std::memory_order_acquire);
+            if (head == head_.tag_load(std::memory_order_relaxed)) {
+                if (head.ptr() == tail.ptr()) {
+                    if (next == nullptr) {
+                        this->record(stats::event::empty);
+                        return false;
+                    }
+                    tail_.compare_exchange_weak(tail, next, std::memory_order_relaxed);
+                }
+                else {
+                    if (head_.compare_exchange_weak(head, next, std::memory_order_acquire)) {
+                        return take(head, next, val);
+                    }
+                    this->record(stats::event::cas_retry);
+                    tail = tail_.tag_load(std::memory_order_acquire);
+                    continue;
+                }
+            }
+            head = head_.tag_load(std::memory_order_acquire);
+            tail = tail_.tag_load(std::memory_order_acquire);
+        }
+    }
+
+    bool try_pop(T& val) {
+        return pop(val);
+    }
+
+    std::tuple<T, bool> pop() {
+        std::tuple<T, bool> ret {};
+        std::get<1>(ret) = pop(std::get<0>(ret));
+        return ret;
+    }
+};
+
+/*
+ * queue on an arena_pool: the nodes live in arena chunks and are linked by 32-bit indices
+ * with 32-bit tags, instead of 48-bit pointers with 16-bit tags.
+ * A node is its link, a release count and the element, 16 bytes for an int instead of 24,
+ * and nodes handed out one after another tend to be neighbours.
+ * A node keeps its link when it is recycled, so its tag is never reset.
+ *
+ * Unbounded like queue: the arena adds a chunk twice the size of the last one when it runs out.
+ * Chunks are kept until the queue dies. A push fails only once the indices run out (about 4G nodes).
+*/
+template <typename T, typename Stats = stats::none>
+class qarena : protected Stats {
+
+    struct node {
+        tagged_index               next_;
+        std::atomic<std::uint32_t> rel_ { 0 }; // see queue::node
+        spsc::detail::slot<T>      data_;
+    };
+
+    enum : std::uint32_t {
+        nil = tagged_index::nil
+    };
+
+    arena_pool<node, Stats> arena_;
+
+    alignas(spsc::cache_line_size) tagged_index head_;
+    alignas(spsc::cache_line_size) tagged_index tail_;
+    alignas(spsc::cache_line_size) std::atomic<std::size_t> live_ { 0 }; // only counted for Stats
+
+    void release(std::uint32_t idx) {
+        if (arena_[idx].rel_.fetch_add(1, std::memory_order_acq_rel) == 1) {
+            arena_.free(idx);
+        }
+    }
+
+    bool take(std::uint32_t head, std::uint32_t next, T& val) {
+        auto& item = arena_[next];
+        val = std::move(item.data_.get());
+        item.data_.destroy();
+        release(next);
+        release(head);
+        if constexpr (Stats::enabled) live_.fetch_sub(1, std::memory_order_relaxed);
+        return true;
+    }
+
+public:
+    using value_type = T;
+
+    enum : std::size_t {
+        default_size = 4096
+    };
+
+    // Room for reserve_n elements up front, the arena has one more node for the dummy.
+    explicit qarena(std::size_t reserve_n = default_size)
+        : arena_(reserve_n + 1) {
+        auto dummy = arena_.alloc();
+        arena_[dummy].rel_.store(1, std::memory_order_relaxed); // has no data to take
+        arena_[dummy].next_.store(nil, std::memory_order_relaxed);
+        head_.store(dummy, std::memory_order_relaxed);
+        tail_.store(dummy, std::memory_order_release);
+    }
+
+    qarena(qarena const &) = delete;
+    qarena& operator=(qarena const &) = delete;
+
+    // The head is the dummy, every node after it holds an element.
+    ~qarena() {
+        auto curr = arena_[head_.load(std::memory_order_relaxed)].next_.load(std::memory_order_relaxed);
+        while (curr != nil) {
+            arena_[curr].data_.destroy();
+            curr = arena_[curr].next_.load(std::memory_order_relaxed);
+        }
+    }
+
+    stats::report stats() const {
+        auto ret = Stats::stats();
+        ret += arena_.stats();
+        return ret;
+    }
+
+    void quit() {}
+
+    bool empty() const {
+        return arena_[head_.load(std::memory_order_acquire)]
+              .next_.load(std::memory_order_relaxed) == nil;
+    }
+
+    template <typename... P>
+    bool emplace(P&&... pars) {
+        auto idx = arena_.alloc();
+        if (idx == nil) {
+            this->record(stats::event::full);
+            return false;
+        }
+        auto& item = arena_[idx];
+        item.data_.construct(std::forward<P>(pars)...);
+        item.rel_.store(0, std::memory_order_relaxed);
+        item.next_.store(nil, std::memory_order_relaxed);
+        if constexpr (Stats::enabled) {
+            this->record_depth(live_.fetch_add(1, std::memory_order_relaxed) + 1);
+        }
+        auto tail = tail_.tag_load(std::memory_order_relaxed);
+        while (1) {
+            auto& last = arena_[tail.index()];
+            auto next = last.next_.tag_load(std::memory_order_acquire);
+            if (tail == tail_.tag_load(std::memory_order_relaxed)) {
+                if (next.index() == nil) {
+                    if (last.next_.compare_exchange_weak(next, idx, std::memory_order_release)) {
+                        tail_.compare_exchange_strong(tail, idx, std::memory_order_release);
+                        return true;
+                    }
+                    this->record(stats::event::cas_retry);
+                }
+                else if (!tail_.compare_exchange_weak(tail, next.index(), std::memory_order_relaxed)) {
+                    continue;
+                }
+            }
+            tail = tail_.tag_load(std::memory_order_relaxed);
+        }
+    }
+
+    bool push(T const & val) {
+        return emplace(val);
+    }
+
+    bool push(T&& val) {
+        return emplace(std::move(val));
+    }
+
+    /*
+     * A node that has been recycled meanwhile still holds a valid index or nil,
+     * so a stale read goes nowhere wrong, and the tags make the CASes built on it fail.
+    */
+    bool pop(T& val) {
+        auto head = head_.tag_load(std::memory_order_acquire);
+        auto tail = tail_.tag_load(std::memory_order_acquire);
+        while (1) {
+            auto next = arena_[head.index()].next_.load(std::memory_order_acquire);
+            if (head == head_.tag_load(std::memory_order_relaxed)) {
+                if (head.index() == tail.index()) {
+                    if (next == nil) {
+                        this->record(stats::event::empty);
+                        return false;
+                    }
+                    tail_.compare_exchange_weak(tail, next, std::memory_order_relaxed);
+                }
+                else {
+                    if (head_.compare_exchange_weak(head, next, std::memory_order_acquire)) {
+                        return take(head.index(), next, val);
+                    }
+                    this->record(stats::event::cas_retry);
+                    tail = tail_.tag_load(std::memory_order_acquire);
+                    continue;
+                }
+            }
+            head = head_.tag_load(std::memory_order_acquire);
+            tail = tail_.tag_load(std::memory_order_acquire);
+        }
+    }
+
+    bool try_pop(T& val) {
+        return pop(val);
+    }
+
+    std::tuple<T, bool> pop() {
+        std::tuple<T, bool> ret {};
+        std::get<1>(ret) = pop(std::get<0>(ret));
+        return ret;
+    }
+};
+
+} // namespace mpmc
+
+namespace spmc {
+
+// Consumers copy a slot before they win it, so every slot holds a live T.
+template <typename T, std::size_t N = spsc::default_capacity, typename Stats = stats::none>
+class qring : public spsc::qring<T, N, Stats, T> {
+    using base_t = spsc::qring<T, N, Stats, T>;
+
+protected:
+    using base_t::rd_;
+    using base_t::wt_;
+    using base_t::block_;
+    using base_t::index_of;
+
+public:
+    using base_t::base_t;
+
+    // the in-place read of spsc::qring assumes a single consumer
+    T*   claim_pop() = delete;
+    void release  () = delete;
+
+    /*
+     * Yet another implementation of a lock-free circular array queue
+     *  - Faustino Frechilla
+     * https://www.codeproject.com/Articles/153898/Yet-another-implementation-of-a-lock-free-circular
+    */
+    bool pop(T& val) {
+        auto cur_rd = rd_.load(std::memory_order_relaxed);
+        while (1) {
+            auto id_rd = index_of(cur_rd);
+            if (id_rd == index_of(wt_.load(std::memory_order_acquire))) {
+                this->record(stats::event::empty);
+                return false;
+            }
+            // the slot may be refilled as soon as rd_ moves on, so it has to be copied before the CAS
+            val = block_[id_rd];
+            if (rd_.compare_exchange_weak(cur_rd, cur_rd + 1, std::memory_order_release)) {
+                return true;
+            }
+            this->record(stats::event::cas_retry);
+        }
+    }
+
+    bool try_pop(T& val) {
+        return pop(val);
+    }
+
+    std::tuple<T, bool> pop() {
+        std::tuple<T, bool> ret {};
+        std::get<1>(ret) = pop(std::get<0>(ret));
+        return ret;
+    }
+};
+
+/*
+ * Broadcast ring: one producer, every reader sees every element.
+ *
+ * Each reader from subscribe() keeps its own read sequence, the producer gates on the slowest one
+ * (a Disruptor sequence barrier) and rescans the readers only when it catches up with the bound
+ * it computed last time. Elements are read in place, peek()/advance() avoid copying them at all.
+ *
+ * With KickLaggards the producer never waits: a reader that falls N elements behind is kicked,
+ * and the next pop() tells it so through kicked(). Such readers may race with the producer on a slot,
+ * copy it and then check they weren't lapped (like a seqlock), so T must be trivially copyable.
+*/
+template <typename T, std::size_t N = spsc::default_capacity, bool KickLaggards = false>
+class qbroadcast : public spsc::detail::ring_storage<T, N> {
+    using base_t = spsc::detail::ring_storage<T, N>;
+
+    static_assert(!KickLaggards || std::is_trivially_copyable<T>::value,
+                  "Readers of a kicking qbroadcast copy slots the producer may be writing.");
+
+public:
+    using value_type = T;
+
+    using typename base_t::ti_t;
+
+private:
+    using base_t::block_;
+    using base_t::index_of;
+
+    struct alignas(spsc::cache_line_size) cursor {
+        std::atomic<ti_t> seq_     { 0 };
+        std::atomic<bool> active_  { false }; // gates the producer
+        std::atomic<bool> kicked_  { false };
+        std::atomic<bool> claimed_ { true };  // owned by a reader
+        cursor*           next_    = nullptr; // never changes once published
+    };
+
+    alignas(spsc::cache_line_size) std::atomic<ti_t> wt_ { 0 };
+    ti_t limit_ = 0; // producer only, wt_ may run up to here before rescanning the readers
+
+    alignas(spsc::cache_line_size) std::atomic<cursor*> readers_ { nullptr };
+
+    cursor* claim() {
+        auto head = readers_.load(std::memory_order_acquire);
+        for (auto c = head; c != nullptr; c = c->next_) {
+            bool expected = false;
+            if (!c->claimed_.load(std::memory_order_relaxed) &&
+                 c->claimed_.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+                return c;
+            }
+        }
+        auto c = new cursor;
+        c->next_ = head;
+        while (!readers_.compare_exchange_weak(c->next_, c, std::memory_order_release)) ;
+        return c;
+    }
+
+    // Returns false if the slowest reader is still a whole ring behind.
+    bool gate(ti_t cur_wt) {
+        ti_t lag = 0;
+        for (auto c = readers_.load(std::memory_order_acquire); c != nullptr; c = c->next_) {
+            if (!c->active_.load(std::memory_order_acquire) ||
+                 c->kicked_.load(std::memory_order_relaxed)) {
+                continue;
+            }
+            auto l = static_cast<ti_t>(cur_wt - c->seq_.load(std::memory_order_acquire));
+            if (KickLaggards && (l >= this->capacity())) {
+                c->kicked_.store(true, std::memory_order_release);
+                continue;
+            }
+            lag = (std::max)(lag, l);
+        }
+        limit_ = static_cast<ti_t>(cur_wt + this->capacity() - lag);
+        return lag < this->capacity();
+    }
+
+public:
+    using base_t::base_t;
+
+    qbroadcast(qbroadcast const &) = delete;
+    qbroadcast& operator=(qbroadcast const &) = delete;
+
+    ~qbroadcast() {
+        auto c = readers_.load(std::memory_order_acquire);
+        while (c != nullptr) {
+            auto temp = c->next_;
+            delete c;
+            c = temp;
+        }
+    }
+
+    // Reads from the point it subscribed. Must not outlive its queue.
+    class reader {
+        friend class qbroadcast;
+        qbroadcast* que_;
+        cursor*     cur_;
+
+        reader(qbroadcast* q, cursor* c) : que_(q), cur_(c) {}
+
+        bool lapped(ti_t seq) const {
+            std::atomic_thread_fence(std::memory_order_acquire);
+            auto wt = que_->wt_.load(std::memory_order_relaxed);
+            if (static_cast<ti_t>(wt - seq) < que_->capacity()) {
+                return false;
+            }
+            cur_->kicked_.store(true, std::memory_order_relaxed);
+            return true;
+        }
+
+    public:
+        reader(reader&& other) noexcept
+            : que_(other.que_), cur_(std::exchange(other.cur_, nullptr))
+        {}
+
+        reader(reader const &) = delete;
+        reader& operator=(reader const &) = delete;
+        reader& operator=(reader&&) = delete;
+
+        ~reader() {
+            if (cur_ == nullptr) return;
+            cur_->active_.store(false, std::memory_order_release);
+            cur_->claimed_.store(false, std::memory_order_release);
+        }
+
+        // Only with KickLaggards: the producer left this reader behind, subscribe again.
+        bool kicked() const {
+            return cur_->kicked_.load(std::memory_order_acquire);
+        }
+
+        bool empty() const {
+            return cur_->seq_.load(std::memory_order_relaxed) == que_->wt_.load(std::memory_order_acquire);
+        }
+
+        bool pop(T& val) {
+            auto seq = cur_->seq_.load(std::memory_order_relaxed);
+            if (kicked() || (seq == que_->wt_.load(std::memory_order_acquire))) {
+                return false;
+            }
+            val = que_->block_[que_->index_of(seq)];
+            if (KickLaggards && lapped(seq)) {
+                return false;
+            }
+            cur_->seq_.store(static_cast<ti_t>(seq + 1), std::memory_order_release);
+            return true;
+        }
+
+        bool try_pop(T& val) {
+            return pop(val);
+        }
+
+        std::tuple<T, bool> pop() {
+            std::tuple<T, bool> ret {};
+            std::get<1>(ret) = pop(std::get<0>(ret));
+            return ret;
+        }
+
+        /*
+         * The next element in place, or nullptr if there is none yet.
+         * It stays valid until advance(), which moves on to the following one.
+        */
+        T const * peek() const {
+            static_assert(!KickLaggards, "A kicking producer may overwrite a slot while it is being read.");
+            auto seq = cur_->seq_.load(std::memory_order_relaxed);
+            if (seq == que_->wt_.load(std::memory_order_acquire)) {
+                return nullptr;
+            }
+            return &(que_->block_[que_->index_of(seq)]);
+        }
+
+        void advance() {
+            cur_->seq_.fetch_add(1, std::memory_order_release);
+        }
+    };
+
+    /*
+     * The sequence is set again after the cursor becomes active:
+     * a producer that computed its bound before may have moved on since.
+    */
+    reader subscribe() {
+        auto c = claim();
+        c->kicked_.store(false, std::memory_order_relaxed);
+        c->seq_.store(wt_.load(std::memory_order_acquire), std::memory_order_relaxed);
+        c->active_.store(true, std::memory_order_seq_cst);
+        c->seq_.store(wt_.load(std::memory_order_seq_cst), std::memory_order_release);
+        return reader { this, c };
+    }
+
+    void quit() {}
+
+    template <typename... P>
+    bool emplace(P&&... pars) {
+        auto cur_wt = wt_.load(std::memory_order_relaxed);
+        if ((cur_wt == limit_) && !gate(cur_wt)) {
+            return false; // full
+        }
+        if constexpr (KickLaggards) {
+            // a lapped reader that sees any of the new data must also see the wt_ it was lapped by
+            std::atomic_thread_fence(std::memory_order_release);
+        }
+        spsc::detail::assign(block_[index_of(cur_wt)], std::forward<P>(pars)...);
+        wt_.store(static_cast<ti_t>(cur_wt + 1), std::memory_order_release);
+        return true;
+    }
+
+    bool push(T const & val) {
+        return emplace(val);
+    }
+
+    bool push(T&& val) {
+        return emplace(std::move(val));
+    }
+};
+
+} // namespace spmc
+
+namespace mpmc {
+
+template <typename T, std::size_t N = spsc::default_capacity,
+          typename W = wait_strategy::yield, typename Stats = stats::none>
+class qlock : public spmc::qring<T, N, Stats> {
+    using base_t = spmc::qring<T, N, Stats>;
+
+protected:
+    using typename base_t::ti_t;
+
+    using base_t::rd_;
+    using base_t::wt_;
+    using base_t::block_;
+    using base_t::index_of;
+
+    std::atomic<ti_t> ct_ { 0 }; // commit index
+
+    W wait_;
+
+public:
+    using base_t::base_t;
+
+    // the in-place write of spsc::qring assumes a single producer
+    T*   claim_push() = delete;
+    void publish   () = delete;
+
+    /*
+     * Yet another implementation of a lock-free circular array queue
+     *  - Faustino Frechilla
+     * https://www.codeproject.com/Articles/153898/Yet-another-implementation-of-a-lock-free-circular
+    */
+    template <typename... P>
+    bool emplace(P&&... pars) {
+        ti_t cur_ct = ct_.load(std::memory_order_acquire), nxt_ct, cur_rd;
+        while (1) {
+            cur_rd = rd_.load(std::memory_order_acquire);
+            if (index_of(nxt_ct = cur_ct + 1) == index_of(cur_rd)) {
+                this->record(stats::event::full);
+                return false;
+            }
+            if (ct_.compare_exchange_weak(cur_ct, nxt_ct, std::memory_order_acq_rel)) {
+                break;
+            }
+            this->record(stats::event::cas_retry);
+        }
+        spsc::detail::assign(block_[index_of(cur_ct)], std::forward<P>(pars)...);
+        // waits for the preceding producers to commit, counted as a CAS retry if it has to
+        this->record_wait(wait_, stats::event::cas_retry, [&] {
+            auto exp_wt = cur_ct;
+            return wt_.compare_exchange_weak(exp_wt, nxt_ct, std::memory_order_release);
+        });
+        wait_.notify();
+        this->record_depth(static_cast<ti_t>(nxt_ct - cur_rd));
+        return true;
+    }
+
+    // emplace() never waits for room, only for producers ahead of it to commit.
+    // Hides spsc::qring::try_emplace, which would write past ct_.
+    template <typename... P>
+    bool try_emplace(P&&... pars) {
+        return emplace(std::forward<P>(pars)...);
+    }
+
+    bool push(T const & val) {
+        return emplace(val);
+    }
+
+    bool push(T&& val) {
+        return emplace(std::move(val));
+    }
+};
+
+enum : std::uint64_t {
+    invalid_index = (std::numeric_limits<std::uint64_t>::max)()
+};
+
+// The nodes live as long as the ring (their flags are always in use), S is the slot of the element.
+template <typename T, typename S = spsc::detail::slot<T>>
+struct rnode {
+    S data_;
+    std::atomic<std::uint64_t> f_ct_ { invalid_index }; // commit flag
+};
+
+// Consumers copy a slot before they win it, so every slot holds a live T.
+template <typename T, std::size_t N = spsc::default_capacity, typename Stats = stats::none>
+class qring : public qlock<rnode<T, T>, N, wait_strategy::yield, Stats> {
+    using base_t = qlock<rnode<T, T>, N, wait_strategy::yield, Stats>;
+
+protected:
+    using typename base_t::ti_t;
+
+    using base_t::rd_;
+    using base_t::wt_;
+    using base_t::ct_;
+    using base_t::block_;
+    using base_t::index_of;
+
+public:
+    using value_type = T;
+
+    using base_t::base_t;
+
+    template <typename... P>
+    bool emplace(P&&... pars) {
+        ti_t cur_ct = ct_.load(std::memory_order_acquire), nxt_ct, cur_rd;
+        while (1) {
+            cur_rd = rd_.load(std::memory_order_acquire);
+            if (index_of(nxt_ct = cur_ct + 1) == index_of(cur_rd)) {
+                this->record(stats::event::full);
+                return false;
+            }
+            if (ct_.compare_exchange_weak(cur_ct, nxt_ct, std::memory_order_acq_rel)) {
+                break;
+            }
+            this->record(stats::event::cas_retry);
+        }
+        this->record_depth(static_cast<ti_t>(nxt_ct - cur_rd));
+        auto* item = &block_[index_of(cur_ct)];
+        spsc::detail::assign(item->data_, std::forward<P>(pars)...);
+        item->f_ct_.store(cur_ct, std::memory_order_release);
+        while (1) {
+            auto cac_ct = item->f_ct_.load(std::memory_order_acquire);
+            if (cur_ct != wt_.load(std::memory_order_acquire)) {
+                return true;
+            }
+            if (cac_ct != cur_ct) {
+                return true;
+            }
+            if (!item->f_ct_.compare_exchange_strong(cac_ct, invalid_index, std::memory_order_relaxed)) {
+                return true;
+            }
+            wt_.store(nxt_ct, std::memory_order_release);
+            cur_ct = nxt_ct;
+            nxt_ct = cur_ct + 1;
+            item = &block_[index_of(cur_ct)];
+        }
+    }
+
+    // Hides qlock::try_emplace, which would write a T into an rnode slot.
+    template <typename... P>
+    bool try_emplace(P&&... pars) {
+        return emplace(std::forward<P>(pars)...);
+    }
+
+    bool push(T const & val) {
+        return emplace(val);
+    }
+
+    bool push(T&& val) {
+        return emplace(std::move(val));
+    }
+
+    bool pop(T& val) {
+        auto cur_rd = rd_.load(std::memory_order_relaxed);
+        while (1) {
+            auto id_rd  = index_of(cur_rd);
+            auto cur_wt = wt_.load(std::memory_order_acquire);
+            if (id_rd == index_of(cur_wt)) {
+                auto* item = &block_[index_of(cur_wt)];
+                auto cac_ct = item->f_ct_.load(std::memory_order_acquire);
+                if (cac_ct != cur_wt) {
+                    this->record(stats::event::empty);
+                    return false;
+                }
+                if (item->f_ct_.compare_exchange_weak(cac_ct, invalid_index, std::memory_order_relaxed)) {
+                    wt_.store(cur_wt + 1, std::memory_order_release);
+                }
+                cur_rd = rd_.load(std::memory_order_relaxed);
+            }
+            else {
+                val = block_[id_rd].data_;
+                if (rd_.compare_exchange_weak(cur_rd, cur_rd + 1, std::memory_order_release)) {
+                    return true;
+                }
+                this->record(stats::event::cas_retry);
+            }
+        }
+    }
+
+    bool try_pop(T& val) {
+        return pop(val);
+    }
+
+    std::tuple<T, bool> pop() {
+        std::tuple<T, bool> ret {};
+        std::get<1>(ret) = pop(std::get<0>(ret));
+        return ret;
+    }
+};
+
+template <typename T, std::size_t N = spsc::default_capacity,
+          typename W = wait_strategy::yield, typename Stats = stats::none>
+class qring2 : public spsc::qring<rnode<T>, N, Stats, rnode<T>> {
+    using base_t = spsc::qring<rnode<T>, N, Stats, rnode<T>>;
+
+protected:
+    using typename base_t::ti_t;
 
     using base_t::rd_;
     using base_t::wt_;
     using base_t::block_;
     using base_t::index_of;
 
-    std::atomic<ti_t> ct_ { 0 }; // commit index
+    std::atomic<bool> quit_ { false };
+
+    W wait_;
+
+    // Consumers take their tickets ahead of the elements, so rd_ may be past cur_wt.
+    void record_depth_at(ti_t cur_wt) {
+        if constexpr (Stats::enabled) {
+            auto depth = static_cast<std::int32_t>(cur_wt + 1 - rd_.load(std::memory_order_relaxed));
+            this->record_depth((depth > 0) ? static_cast<std::uint64_t>(depth) : 0);
+        }
+    }
+
+    // The slot is free for cur_wt: released by the previous round, or never used and cur_wt is in the first round.
+    bool writable(rnode<T> const & item, ti_t cur_wt) const {
+        auto cac_id = item.f_ct_.load(std::memory_order_acquire);
+        return (cac_id == cur_wt) || ((cac_id == invalid_index) && (cur_wt < this->capacity()));
+    }
+
+    void wait_writable(rnode<T>& item, ti_t cur_wt) {
+        this->record_wait(wait_, stats::event::full, [&] {
+            return writable(item, cur_wt);
+        });
+        record_depth_at(cur_wt);
+    }
+
+    bool wait_readable(rnode<T>& item, ti_t cur_rd) {
+        bool ret = false;
+        this->record_wait(wait_, stats::event::empty, [&] {
+            ret = (item.f_ct_.load(std::memory_order_acquire) == static_cast<ti_t>(~cur_rd));
+            return ret || quit_.load(std::memory_order_relaxed);
+        });
+        return ret;
+    }
+
+    void commit_write(rnode<T>& item, ti_t cur_wt) {
+        item.f_ct_.store(static_cast<ti_t>(~cur_wt), std::memory_order_release);
+        wait_.notify();
+    }
+
+    void commit_read(rnode<T>& item, ti_t cur_rd) {
+        item.f_ct_.store(static_cast<ti_t>(cur_rd + this->capacity()), std::memory_order_release);
+        wait_.notify();
+    }
+
+public:
+    using value_type = T;
+
+    using base_t::base_t;
+
+    /*
+     * Each slot's last write ticket, the one of the last capacity() below wt_, tells what it holds:
+     * published (or claimed by a consumer) if the slot has its complement, claimed by a producer
+     * and not published yet if the slot is still writable for it, free otherwise.
+     * Consumers may have taken tickets past wt_ after quit(), so rd_ is not looked at.
+    */
+    ~qring2() {
+        auto cur_wt = wt_.load(std::memory_order_relaxed);
+        for (ti_t k = 1; k <= this->capacity(); ++k) {
+            auto id = static_cast<ti_t>(cur_wt - k);
+            auto& item = block_[index_of(id)];
+            if ((item.f_ct_.load(std::memory_order_relaxed) == static_cast<ti_t>(~id)) || writable(item, id)) {
+                item.data_.destroy();
+            }
+        }
+    }
+
+    /*
+     * A slot handed out by claim_push()/claim_pop().
+     * It refers to the element inside the ring, and remembers the ticket
+     * that has to be passed back to publish()/release().
+    */
+    class claim {
+        friend class qring2;
+
+        T*   data_;
+        ti_t id_;
+
+        claim(T* data, ti_t id) : data_(data), id_(id) {}
+
+    public:
+        explicit operator bool() const noexcept { return data_ != nullptr; }
+
+        T* get       () const noexcept { return  data_; }
+        T& operator* () const noexcept { return *data_; }
+        T* operator->() const noexcept { return  data_; }
+    };
+
+    void quit() {
+        quit_.store(true, std::memory_order_relaxed);
+        wait_.notify();
+    }
+
+    /*
+     * Unlike the ones of spsc::qring, these only look at published slots:
+     * empty() means the next pop ticket has no element yet, full() means the next push ticket
+     * has no room yet, whatever the tickets already handed out are doing.
+    */
+
+    bool empty() const {
+        auto cur_rd = rd_.load(std::memory_order_relaxed);
+        return block_[index_of(cur_rd)].f_ct_.load(std::memory_order_acquire) != static_cast<ti_t>(~cur_rd);
+    }
+
+    bool full() const {
+        auto cur_wt = wt_.load(std::memory_order_relaxed);
+        return !writable(block_[index_of(cur_wt)], cur_wt);
+    }
+
+    /*
+     * A bounded wait-free(almost) zero-copy MPMC queue written in C++11, which can also reside in SHM for IPC
+     *  - MengRao/WFMPMC
+     * https://github.com/MengRao/WFMPMC
+    */
+
+    template <typename... P>
+    bool emplace(P&&... pars) {
+        auto cur_wt = wt_.fetch_add(1, std::memory_order_relaxed);
+        auto& item = block_[index_of(cur_wt)];
+        wait_writable(item, cur_wt);
+        item.data_.construct(std::forward<P>(pars)...);
+        commit_write(item, cur_wt);
+        return true;
+    }
+
+    bool push(T const & val) {
+        return emplace(val);
+    }
+
+    bool push(T&& val) {
+        return emplace(std::move(val));
+    }
+
+    /*
+     * Unlike emplace(), only takes a ticket whose slot is free already,
+     * so it never waits, and returns false when the ring is full.
+    */
+    template <typename... P>
+    bool try_emplace(P&&... pars) {
+        auto cur_wt = wt_.load(std::memory_order_relaxed);
+        while (1) {
+            auto& item = block_[index_of(cur_wt)];
+            if (!writable(item, cur_wt)) {
+                this->record(stats::event::full);
+                return false;
+            }
+            if (wt_.compare_exchange_weak(cur_wt, cur_wt + 1, std::memory_order_relaxed)) {
+                record_depth_at(cur_wt);
+                item.data_.construct(std::forward<P>(pars)...);
+                commit_write(item, cur_wt);
+                return true;
+            }
+            this->record(stats::event::cas_retry);
+        }
+    }
+
+    bool try_push(T const & val) {
+        return try_emplace(val);
+    }
+
+    bool try_push(T&& val) {
+        return try_emplace(std::move(val));
+    }
+
+    bool pop(T& val) {
+        auto cur_rd = rd_.fetch_add(1, std::memory_order_relaxed);
+        auto& item = block_[index_of(cur_rd)];
+        if (!wait_readable(item, cur_rd)) {
+            return false;
+        }
+        val = std::move(item.data_.get());
+        item.data_.destroy();
+        commit_read(item, cur_rd);
+        return true;
+    }
+
+    /*
+     * Unlike pop(), only takes a ticket whose element has been published already,
+     * so it never waits.
+    */
+    bool try_pop(T& val) {
+        auto cur_rd = rd_.load(std::memory_order_relaxed);
+        while (1) {
+            auto& item = block_[index_of(cur_rd)];
+            if (item.f_ct_.load(std::memory_order_acquire) != static_cast<ti_t>(~cur_rd)) {
+                this->record(stats::event::empty);
+                return false;
+            }
+            if (rd_.compare_exchange_weak(cur_rd, cur_rd + 1, std::memory_order_relaxed)) {
+                val = std::move(item.data_.get());
+                item.data_.destroy();
+                commit_read(item, cur_rd);
+                return true;
+            }
+            this->record(stats::event::cas_retry);
+        }
+    }
+
+    std::tuple<T, bool> pop() {
+        std::tuple<T, bool> ret {};
+        std::get<1>(ret) = pop(std::get<0>(ret));
+        return ret;
+    }
+
+    /*
+     * Zero-copy interface.
+     * claim_push() waits for a free slot (like push), default-initializes the element in it and hands it out,
+     * it is filled in place and becomes visible to consumers on publish().
+     * claim_pop() waits for an element (like pop) and hands it out in place, it is destroyed and
+     * the slot recycled on release(). An empty claim is returned after quit().
+    */
+
+    claim claim_push() {
+        auto cur_wt = wt_.fetch_add(1, std::memory_order_relaxed);
+        auto& item = block_[index_of(cur_wt)];
+        wait_writable(item, cur_wt);
+        return { item.data_.construct_default(), cur_wt };
+    }
+
+    void publish(claim const & c) {
+        commit_write(block_[index_of(c.id_)], c.id_);
+    }
+
+    claim claim_pop() {
+        auto cur_rd = rd_.fetch_add(1, std::memory_order_relaxed);
+        auto& item = block_[index_of(cur_rd)];
+        if (!wait_readable(item, cur_rd)) {
+            return { nullptr, cur_rd };
+        }
+        return { &item.data_.get(), cur_rd };
+    }
+
+    void release(claim const & c) {
+        auto& item = block_[index_of(c.id_)];
+        item.data_.destroy();
+        commit_read(item, c.id_);
+    }
+
+    /*
+     * Claims n consecutive tickets with a single fetch_add,
+     * then fills the matching slots in order.
+    */
+    template <typename It>
+    std::size_t push_n(It first, std::size_t n) {
+        if (n == 0) return 0;
+        auto cur_wt = wt_.fetch_add(static_cast<ti_t>(n), std::memory_order_relaxed);
+        for (std::size_t i = 0; i < n; ++i, ++first, ++cur_wt) {
+            auto& item = block_[index_of(cur_wt)];
+            wait_writable(item, cur_wt);
+            item.data_.construct(*first);
+            commit_write(item, cur_wt);
+        }
+        return n;
+    }
+
+    /*
+     * Takes up to n elements into out with a single CAS on rd_.
+     * The batch is capped by the tickets producers have claimed, and the CAS fails if other consumers
+     * took some of them meanwhile, so consumers together never claim past wt_ this way.
+     * With no ticket claimed by a producer it takes one like pop() does, and waits for it.
+     * Returns the number of elements taken, which is short of the claim only after quit().
+    */
+    template <typename It>
+    std::size_t pop_n(It out, std::size_t n) {
+        if (n == 0) return 0;
+        std::size_t k = 1;
+        auto cur_rd = rd_.load(std::memory_order_relaxed);
+        while (1) {
+            auto avail = static_cast<std::int32_t>(wt_.load(std::memory_order_relaxed) - cur_rd);
+            if (avail <= 0) {
+                cur_rd = rd_.fetch_add(1, std::memory_order_relaxed);
+                break;
+            }
+            k = (std::min)(n, static_cast<std::size_t>(avail));
+            if (rd_.compare_exchange_weak(cur_rd, static_cast<ti_t>(cur_rd + k), std::memory_order_relaxed)) {
+                break;
+            }
+            this->record(stats::event::cas_retry);
+        }
+        for (std::size_t i = 0; i < k; ++i, ++out, ++cur_rd) {
+            auto& item = block_[index_of(cur_rd)];
+            if (!wait_readable(item, cur_rd)) {
+                return i;
+            }
+            *out = std::move(item.data_.get());
+            item.data_.destroy();
+            commit_read(item, cur_rd);
+        }
+        return k;
+    }
+};
+
+namespace detail {
+
+/*
+ * SCQ index ring: a queue of indices in [0, N), backed by 2N entries.
+ *
+ * Head and tail only move by fetch_add, a slot is taken or given back with one CAS or OR
+ * on its entry, which carries the cycle of the ticket that wrote it, a safe bit and the index.
+ * threshold_ bounds how far dequeuers may run past the tail, so the ring is livelock-free.
+ *
+ * A Scalable, Portable, and Memory-Efficient Lock-Free FIFO Queue - Ruslan Nikolaev
+ * https://arxiv.org/abs/1908.04511
+*/
+constexpr unsigned log2_of(std::size_t n) noexcept {
+    unsigned k = 0;
+    while ((std::size_t(1) << k) < n) ++k;
+    return k;
+}
+
+template <std::size_t N>
+class scq_ring {
+    static_assert(spsc::detail::is_pow2(N), "The capacity of a ring must be a power of two.");
+    static_assert(N >= 2, "An SCQ ring needs at least two slots.");
+
+    enum : std::uint64_t {
+        ring_size  = 2 * N,
+        index_bits = log2_of(2 * N),
+        safe_bit   = std::uint64_t(1) << index_bits,
+        index_mask = ring_size - 1,
+        bottom     = ring_size - 1, // no index
+        bottom_c   = ring_size - 2  // consumed, OR-ed into a live index it yields bottom or bottom_c
+    };
+
+    // maps consecutive tickets to entries on different cache lines
+    static std::size_t remap(std::uint64_t ticket) noexcept {
+        constexpr unsigned line_bits = 3; // 8 entries of 8 bytes per cache line
+        auto pos = static_cast<std::size_t>(ticket & index_mask);
+        if constexpr (index_bits <= line_bits) {
+            return pos;
+        }
+        else {
+            return (pos >> (index_bits - line_bits)) | ((pos << line_bits) & index_mask);
+        }
+    }
+
+    static std::uint64_t cycle_of  (std::uint64_t ticket) noexcept { return ticket >> index_bits; }
+    static std::uint64_t entry_cycle(std::uint64_t e)     noexcept { return e >> (index_bits + 1); }
+    static std::uint64_t entry_index(std::uint64_t e)     noexcept { return e & index_mask; }
+    static bool          entry_safe (std::uint64_t e)     noexcept { return (e & safe_bit) != 0; }
+
+    static std::uint64_t make_entry(std::uint64_t cycle, bool safe, std::uint64_t index) noexcept {
+        return (cycle << (index_bits + 1)) | (safe ? std::uint64_t(safe_bit) : std::uint64_t(0)) | index;
+    }
+
+    alignas(spsc::cache_line_size) std::atomic<std::uint64_t> head_      { ring_size };
+    alignas(spsc::cache_line_size) std::atomic<std::uint64_t> tail_      { ring_size };
+    alignas(spsc::cache_line_size) std::atomic<std::int64_t>  threshold_ { -1 };
+    alignas(spsc::cache_line_size) std::atomic<std::uint64_t> entries_[ring_size];
+
+    void catchup(std::uint64_t tail, std::uint64_t head) {
+        while (!tail_.compare_exchange_weak(tail, head, std::memory_order_acq_rel)) {
+            head = head_.load(std::memory_order_acquire);
+            tail = tail_.load(std::memory_order_acquire);
+            if (tail >= head) break;
+        }
+    }
 
 public:
-    /*
-     * Yet another implementation of a lock-free circular array queue
-     *  - Faustino Frechilla
-     * https://www.codeproject.com/Articles/153898/Yet-another-implementation-of-a-lock-free-circular
-    */
-    bool push(T const & val) {
-        ti_t cur_ct = ct_.load(std::memory_order_acquire), nxt_ct;
+    enum : std::size_t { npos = ~std::size_t(0) };
+
+    scq_ring() {
+        for (auto& e : entries_) e.store(make_entry(0, true, bottom), std::memory_order_relaxed);
+    }
+
+    void enqueue(std::size_t index) {
         while (1) {
-            if (index_of(nxt_ct = cur_ct + 1) ==
-                index_of(rd_.load(std::memory_order_acquire))) {
-                return false; // full
-            }
-            if (ct_.compare_exchange_weak(cur_ct, nxt_ct, std::memory_order_acq_rel)) {
-                break;
+            auto t = tail_.fetch_add(1, std::memory_order_acq_rel);
+            auto& ent = entries_[remap(t)];
+            auto e = ent.load(std::memory_order_acquire);
+            while ((entry_cycle(e) < cycle_of(t)) && (entry_index(e) >= bottom_c) &&
+                   (entry_safe(e) || (head_.load(std::memory_order_acquire) <= t))) {
+                if (ent.compare_exchange_weak(e, make_entry(cycle_of(t), true, index), std::memory_order_acq_rel)) {
+                    if (threshold_.load(std::memory_order_relaxed) != std::int64_t(3 * N - 1)) {
+                        threshold_.store(std::int64_t(3 * N - 1), std::memory_order_release);
+                    }
+                    return;
+                }
             }
         }
-        block_[index_of(cur_ct)] = val;
+    }
+
+    // Returns npos when the ring is empty.
+    std::size_t dequeue() {
+        if (threshold_.load(std::memory_order_acquire) < 0) {
+            return npos;
+        }
         while (1) {
-//            if (cur_ct == wt_.load(std::memory_order_relaxed)) {
-//                wt_.store(nxt_ct, std::memory_order_release);
-//                return true;
-//            }
-            auto exp_wt = cur_ct;
-            if (wt_.compare_exchange_weak(exp_wt, nxt_ct, std::memory_order_release)) {
-                return true;
+            auto h = head_.fetch_add(1, std::memory_order_acq_rel);
+            auto& ent = entries_[remap(h)];
+            auto e = ent.load(std::memory_order_acquire);
+            while (1) {
+                if (entry_cycle(e) == cycle_of(h)) {
+                    ent.fetch_or(bottom_c, std::memory_order_acq_rel);
+                    return static_cast<std::size_t>(entry_index(e));
+                }
+                auto next = make_entry(entry_cycle(e), false, entry_index(e));
+                if (entry_index(e) >= bottom_c) {
+                    next = make_entry(cycle_of(h), entry_safe(e), bottom);
+                }
+                if ((entry_cycle(e) < cycle_of(h)) &&
+                    !ent.compare_exchange_weak(e, next, std::memory_order_acq_rel)) {
+                    continue;
+                }
+                break;
+            }
+            auto t = tail_.load(std::memory_order_acquire);
+            if (t <= h + 1) {
+                catchup(t, h + 1);
+                threshold_.fetch_sub(1, std::memory_order_acq_rel);
+                return npos;
+            }
+            if (threshold_.fetch_sub(1, std::memory_order_acq_rel) <= 0) {
+                return npos;
             }
-            std::this_thread::yield();
         }
     }
-};
-
-enum : std::uint64_t {
-    invalid_index = (std::numeric_limits<std::uint64_t>::max)()
-};
 
-template <typename T>
-struct rnode {
-    T data_;
-    std::atomic<std::uint64_t> f_ct_ { invalid_index }; // commit flag
+    bool empty() const {
+        return (threshold_.load(std::memory_order_acquire) < 0) ||
+               (head_.load(std::memory_order_acquire) >= tail_.load(std::memory_order_acquire));
+    }
 };
 
-template <typename T>
-class qring : public qlock<rnode<T>> {
-    using base_t = qlock<rnode<T>>;
+} // namespace detail
 
-protected:
-    using typename base_t::ti_t;
+/*
+ * Bounded MPMC ring without CAS retry loops on shared indices (SCQ).
+ *
+ * A push takes a free slot index from fq_, fills the slot and puts the index into aq_,
+ * a pop does the reverse. Both index rings are lock-free, so a stalled thread never blocks the others,
+ * and push() returns false when the ring is full instead of waiting.
+*/
+template <typename T, std::size_t N = spsc::default_capacity>
+class qscq {
 
-    using base_t::rd_;
-    using base_t::wt_;
-    using base_t::ct_;
-    using base_t::block_;
-    using base_t::index_of;
+    detail::scq_ring<N> aq_; // indices of filled slots
+    detail::scq_ring<N> fq_; // indices of free slots
+    spsc::detail::slot<T> block_[N];
 
 public:
+    using value_type = T;
+
+    qscq() {
+        for (std::size_t i = 0; i < N; ++i) fq_.enqueue(i);
+    }
+
+    ~qscq() {
+        for (auto id = aq_.dequeue(); id != aq_.npos; id = aq_.dequeue()) {
+            block_[id].destroy();
+        }
+    }
+
+    static constexpr std::size_t capacity() noexcept {
+        return N;
+    }
+
+    void quit() {}
+
+    bool empty() const {
+        return aq_.empty();
+    }
+
+    template <typename... P>
+    bool emplace(P&&... pars) {
+        auto id = fq_.dequeue();
+        if (id == fq_.npos) {
+            return false;
+        }
+        block_[id].construct(std::forward<P>(pars)...);
+        aq_.enqueue(id);
+        return true;
+    }
+
     bool push(T const & val) {
-        ti_t cur_ct = ct_.load(std::memory_order_acquire), nxt_ct;
-        while (1) {
-            if (index_of(nxt_ct = cur_ct + 1) ==
-                index_of(rd_.load(std::memory_order_acquire))) {
-                return false; // full
+        return emplace(val);
+    }
+
+    bool push(T&& val) {
+        return emplace(std::move(val));
+    }
+
+    bool pop(T& val) {
+        auto id = aq_.dequeue();
+        if (id == aq_.npos) {
+            return false;
+        }
+        val = std::move(block_[id].get());
+        block_[id].destroy();
+        fq_.enqueue(id);
+        return true;
+    }
+
+    bool try_pop(T& val) {
+        return pop(val);
+    }
+
+    std::tuple<T, bool> pop() {
+        std::tuple<T, bool> ret {};
+        std::get<1>(ret) = pop(std::get<0>(ret));
+        return ret;
+    }
+};
+
+/*
+ * Unbounded queue made of linked ring segments of N slots.
+ *
+ * Producers claim a slot with a fetch_add on the tail segment and link a new segment when it fills,
+ * consumers claim slots the same way on the head segment.
+ * A consumer that gets to a slot before its producer poisons it, and the producer claims another one.
+ * Drained segments are retired to reclaim::domain and go back to the pool after the grace period,
+ * so there is one allocation per N elements at most, none in steady state.
+ *
+ * Fast Concurrent Queues for x86 Processors (LCRQ) - Adam Morrison, Yehuda Afek
+ * FAAArrayQueue - Pedro Ramalhete, Andreia Correia
+*/
+template <typename T, std::size_t N = 1024>
+class qseg {
+    using ti_t = std::uint32_t;
+
+    enum : unsigned {
+        slot_empty,
+        slot_writing,
+        slot_ready,
+        slot_dead      // poisoned or already taken
+    };
+
+    struct slot {
+        std::atomic<unsigned> f_ { slot_empty };
+        spsc::detail::slot<T> data_;
+    };
+
+    struct segment {
+        alignas(spsc::cache_line_size) std::atomic<ti_t> wt_ { 0 };
+        alignas(spsc::cache_line_size) std::atomic<ti_t> rd_ { 0 };
+        alignas(spsc::cache_line_size) std::atomic<segment*> next_ { nullptr };
+        slot slots_[N];
+
+        segment() {} // leaves the data uninitialized
+
+        ~segment() {
+            for (auto& s : slots_) {
+                if (s.f_.load(std::memory_order_relaxed) == slot_ready) s.data_.destroy();
             }
-            if (ct_.compare_exchange_weak(cur_ct, nxt_ct, std::memory_order_acq_rel)) {
-                break;
+        }
+    };
+
+    list_pool<segment> allocator_;
+
+    alignas(spsc::cache_line_size) std::atomic<segment*> head_ { allocator_.alloc() };
+    alignas(spsc::cache_line_size) std::atomic<segment*> tail_ { head_.load(std::memory_order_relaxed) };
+
+    static void recycle(void* owner, void* p) {
+        auto seg = static_cast<segment*>(p);
+        seg->~segment();
+        static_cast<qseg*>(owner)->allocator_.free(seg);
+    }
+
+    // Links a new segment after full, or helps whoever did.
+    void extend(segment* full) {
+        auto next = full->next_.load(std::memory_order_acquire);
+        if (next == nullptr) {
+            auto seg = allocator_.alloc();
+            if (full->next_.compare_exchange_strong(next, seg, std::memory_order_acq_rel)) {
+                next = seg;
+            }
+            else {
+                seg->~segment();
+                allocator_.free(seg);
             }
         }
-        auto* item = block_ + index_of(cur_ct);
-        item->data_ = val;
-        item->f_ct_.store(cur_ct, std::memory_order_release);
+        tail_.compare_exchange_strong(full, next, std::memory_order_release);
+    }
+
+public:
+    using value_type = T;
+
+    ~qseg() {
+        reclaim::domain::instance().drain(this);
+        auto curr = head_.load(std::memory_order_relaxed);
+        while (curr != nullptr) {
+            auto temp = curr->next_.load(std::memory_order_relaxed);
+            curr->~segment();
+            allocator_.free(curr);
+            curr = temp;
+        }
+    }
+
+    void quit() {}
+
+    bool empty() const {
+        reclaim::guard g;
+        auto head = head_.load(std::memory_order_acquire);
+        return (head->rd_.load(std::memory_order_relaxed) >= head->wt_.load(std::memory_order_relaxed)) &&
+               (head->next_.load(std::memory_order_acquire) == nullptr);
+    }
+
+    template <typename... P>
+    bool emplace(P&&... pars) {
+        reclaim::guard g;
         while (1) {
-            auto cac_ct = item->f_ct_.load(std::memory_order_acquire);
-            if (cur_ct != wt_.load(std::memory_order_acquire)) {
-                return true;
-            }
-            if (cac_ct != cur_ct) {
-                return true;
+            auto tail = tail_.load(std::memory_order_acquire);
+            auto id   = tail->wt_.fetch_add(1, std::memory_order_relaxed);
+            if (id >= N) {
+                extend(tail);
+                continue;
             }
-            if (!item->f_ct_.compare_exchange_strong(cac_ct, invalid_index, std::memory_order_relaxed)) {
+            auto& s = tail->slots_[id];
+            unsigned f = slot_empty;
+            if (s.f_.compare_exchange_strong(f, slot_writing, std::memory_order_acquire)) {
+                s.data_.construct(std::forward<P>(pars)...);
+                s.f_.store(slot_ready, std::memory_order_release);
                 return true;
             }
-            wt_.store(nxt_ct, std::memory_order_release);
-            cur_ct = nxt_ct;
-            nxt_ct = cur_ct + 1;
-            item = block_ + index_of(cur_ct);
+            // a consumer has poisoned the slot, claim another one
         }
     }
 
-    std::tuple<T, bool> pop() {
-        auto cur_rd = rd_.load(std::memory_order_relaxed);
+    bool push(T const & val) {
+        return emplace(val);
+    }
+
+    bool push(T&& val) {
+        return emplace(std::move(val));
+    }
+
+    bool pop(T& val) {
+        reclaim::guard g;
         while (1) {
-            auto id_rd  = index_of(cur_rd);
-            auto cur_wt = wt_.load(std::memory_order_acquire);
-            if (id_rd == index_of(cur_wt)) {
-                auto* item = block_ + index_of(cur_wt);
-                auto cac_ct = item->f_ct_.load(std::memory_order_acquire);
-                if (cac_ct != cur_wt) {
-                    return {}; // empty
+            auto head = head_.load(std::memory_order_acquire);
+            if ((head->rd_.load(std::memory_order_relaxed) >= head->wt_.load(std::memory_order_relaxed)) &&
+                (head->next_.load(std::memory_order_acquire) == nullptr)) {
+                return false;
+            }
+            auto id = head->rd_.fetch_add(1, std::memory_order_relaxed);
+            if (id >= N) {
+                auto next = head->next_.load(std::memory_order_acquire);
+                if (next == nullptr) {
+                    return false;
                 }
-                if (item->f_ct_.compare_exchange_weak(cac_ct, invalid_index, std::memory_order_relaxed)) {
-                    wt_.store(cur_wt + 1, std::memory_order_release);
+                // tail_ must not be left on a retired segment
+                auto tail = head;
+                tail_.compare_exchange_strong(tail, next, std::memory_order_release);
+                if (head_.compare_exchange_strong(head, next, std::memory_order_acq_rel)) {
+                    reclaim::domain::instance().retire(this, head, &recycle);
                 }
-                cur_rd = rd_.load(std::memory_order_relaxed);
+                continue;
             }
-            else {
-                auto ret = std::make_tuple(block_[id_rd].data_, true);
-                if (rd_.compare_exchange_weak(cur_rd, cur_rd + 1, std::memory_order_release)) {
-                    return ret;
-                }
+            auto& s = head->slots_[id];
+            unsigned f = slot_empty;
+            if (s.f_.compare_exchange_strong(f, slot_dead, std::memory_order_acquire)) {
+                continue; // got here before the producer
             }
+            while (f != slot_ready) {
+                std::this_thread::yield(); // the producer is constructing the data
+                f = s.f_.load(std::memory_order_acquire);
+            }
+            val = std::move(s.data_.get());
+            s.data_.destroy();
+            s.f_.store(slot_dead, std::memory_order_relaxed);
+            return true;
         }
     }
-};
 
-template <typename T>
-class qring2 : public spsc::qring<rnode<T>> {
-    using base_t = spsc::qring<rnode<T>>;
+    bool try_pop(T& val) {
+        return pop(val);
+    }
 
-protected:
-    using base_t::rd_;
-    using base_t::wt_;
-    using base_t::block_;
-    using base_t::index_of;
+    std::tuple<T, bool> pop() {
+        std::tuple<T, bool> ret {};
+        std::get<1>(ret) = pop(std::get<0>(ret));
+        return ret;
+    }
+};
 
-    std::atomic<bool> quit_ { false };
+namespace detail {
+
+/*
+ * Ids of the qtoken queues alive, never reused.
+ * A thread leaving gives its implicit sub-queues back only to queues still in here,
+ * and a thread drops the entries of dead queues from its list before it adds one.
+*/
+class token_registry {
+    std::mutex                        lock_;
+    std::unordered_set<std::uint64_t> live_;
+    std::uint64_t                     next_ = 0;
 
 public:
-    void quit() {
-        quit_.store(true, std::memory_order_relaxed);
+    static token_registry& instance() {
+        static token_registry reg;
+        return reg;
     }
 
-    /*
-     * A bounded wait-free(almost) zero-copy MPMC queue written in C++11, which can also reside in SHM for IPC
-     *  - MengRao/WFMPMC
-     * https://github.com/MengRao/WFMPMC
-    */
+    std::uint64_t add() {
+        auto guard = std::unique_lock { lock_ };
+        live_.insert(next_);
+        return next_++;
+    }
 
-    bool push(T const & val) {
-        auto cur_wt = wt_.fetch_add(1, std::memory_order_relaxed);
-        auto& item = block_[index_of(cur_wt)];
-        while (1) {
-            auto cac_id = item.f_ct_.load(std::memory_order_acquire);
-            if (cac_id == cur_wt || cac_id == invalid_index) {
-                break;
+    void remove(std::uint64_t id) {
+        auto guard = std::unique_lock { lock_ };
+        live_.erase(id);
+    }
+
+    template <typename F>
+    void if_alive(std::uint64_t id, F&& f) {
+        auto guard = std::unique_lock { lock_ };
+        if (live_.count(id) != 0) f();
+    }
+
+    // Drops the entries of v whose id_ is no longer alive, under a single lock.
+    template <typename V>
+    void erase_dead(V& v) {
+        auto guard = std::unique_lock { lock_ };
+        v.erase(std::remove_if(v.begin(), v.end(), [this](auto const & e) { return live_.count(e.id_) == 0; }), v.end());
+    }
+};
+
+} // namespace detail
+
+/*
+ * MPMC queue made of one spmc::qring per producer.
+ *
+ * A producer pushes into its own sub-queue, through an explicit token from make_token(),
+ * or through an implicit one the first time a thread pushes without a token.
+ * Producers never touch each other's cache lines, consumers visit the sub-queues in turn,
+ * starting from the one that last had data. Each producer can run N - 1 elements ahead.
+ *
+ * There is no order between elements of different producers.
+*/
+template <typename T, std::size_t N = spsc::default_capacity>
+class qtoken {
+
+    struct sub {
+        spmc::qring<T, N> que_;
+        std::atomic<bool> in_use_ { true };
+        sub*              next_   = nullptr; // never changes once published
+    };
+
+    alignas(spsc::cache_line_size) std::atomic<sub*> head_ { nullptr };
+    alignas(spsc::cache_line_size) std::atomic<sub*> hint_ { nullptr };
+    std::uint64_t const id_ = detail::token_registry::instance().add();
+
+    sub* acquire() {
+        auto head = head_.load(std::memory_order_acquire);
+        for (auto s = head; s != nullptr; s = s->next_) {
+            bool expected = false;
+            if (!s->in_use_.load(std::memory_order_relaxed) &&
+                 s->in_use_.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+                return s;
             }
-            std::this_thread::yield(); // full
         }
-        item.data_ = val;
-        item.f_ct_.store(static_cast<decltype(cur_wt)>(~cur_wt), std::memory_order_release);
-        return true;
+        auto s = new sub;
+        s->next_ = head;
+        while (!head_.compare_exchange_weak(s->next_, s, std::memory_order_release)) ;
+        return s;
     }
 
-    std::tuple<T, bool> pop() {
-        auto cur_rd = rd_.fetch_add(1, std::memory_order_relaxed);
-        auto& item = block_[index_of(cur_rd)];
-        while (item.f_ct_.load(std::memory_order_acquire) != static_cast<decltype(cur_rd)>(~cur_rd)) {
-            if (quit_.load(std::memory_order_relaxed)) {
-                return {};
+    struct implicit_list {
+        struct entry {
+            std::uint64_t id_;
+            sub*          sub_;
+        };
+        std::vector<entry> entries_;
+
+        ~implicit_list() {
+            auto& reg = detail::token_registry::instance();
+            for (auto& e : entries_) {
+                reg.if_alive(e.id_, [&] { e.sub_->in_use_.store(false, std::memory_order_release); });
+            }
+        }
+    };
+
+    sub* implicit() {
+        thread_local implicit_list list;
+        if (!list.entries_.empty() && (list.entries_.back().id_ == id_)) {
+            return list.entries_.back().sub_;
+        }
+        for (auto& e : list.entries_) {
+            if (e.id_ == id_) {
+                std::swap(e, list.entries_.back()); // checked first next time
+                return list.entries_.back().sub_;
             }
-            std::this_thread::yield(); // empty
         }
-        auto ret = std::make_tuple(item.data_, true);
-        item.f_ct_.store(cur_rd + base_t::elem_max, std::memory_order_release);
+        // a miss is rare (once per queue and thread), so clean up after the queues that died meanwhile
+        detail::token_registry::instance().erase_dead(list.entries_);
+        auto s = acquire();
+        list.entries_.push_back({ id_, s });
+        return s;
+    }
+
+public:
+    using value_type = T;
+
+    // Owns a sub-queue until destroyed. Must not outlive its queue.
+    class token {
+        friend class qtoken;
+        sub* sub_;
+
+        explicit token(sub* s) : sub_(s) {}
+
+    public:
+        token(token&& other) noexcept
+            : sub_(std::exchange(other.sub_, nullptr))
+        {}
+
+        token(token const &) = delete;
+        token& operator=(token const &) = delete;
+        token& operator=(token&&) = delete;
+
+        ~token() {
+            if (sub_ != nullptr) sub_->in_use_.store(false, std::memory_order_release);
+        }
+    };
+
+    qtoken() = default;
+    qtoken(qtoken const &) = delete;
+    qtoken& operator=(qtoken const &) = delete;
+
+    ~qtoken() {
+        detail::token_registry::instance().remove(id_);
+        auto s = head_.load(std::memory_order_acquire);
+        while (s != nullptr) {
+            auto temp = s->next_;
+            delete s;
+            s = temp;
+        }
+    }
+
+    token make_token() {
+        return token { acquire() };
+    }
+
+    void quit() {}
+
+    bool empty() const {
+        for (auto s = head_.load(std::memory_order_acquire); s != nullptr; s = s->next_) {
+            if (!s->que_.empty()) return false;
+        }
+        return true;
+    }
+
+    template <typename... P>
+    bool emplace(token& tk, P&&... pars) {
+        return tk.sub_->que_.emplace(std::forward<P>(pars)...);
+    }
+
+    bool push(token& tk, T const & val) {
+        return emplace(tk, val);
+    }
+
+    bool push(token& tk, T&& val) {
+        return emplace(tk, std::move(val));
+    }
+
+    template <typename... P>
+    bool emplace(P&&... pars) {
+        return implicit()->que_.emplace(std::forward<P>(pars)...);
+    }
+
+    bool push(T const & val) {
+        return emplace(val);
+    }
+
+    bool push(T&& val) {
+        return emplace(std::move(val));
+    }
+
+    bool pop(T& val) {
+        auto start = hint_.load(std::memory_order_relaxed);
+        if (start == nullptr) {
+            start = head_.load(std::memory_order_acquire);
+            if (start == nullptr) return false;
+        }
+        auto s = start;
+        do {
+            if (s->que_.pop(val)) {
+                if (s != start) hint_.store(s, std::memory_order_relaxed);
+                return true;
+            }
+            s = (s->next_ != nullptr) ? s->next_ : head_.load(std::memory_order_acquire);
+        } while (s != start);
+        return false;
+    }
+
+    bool try_pop(T& val) {
+        return pop(val);
+    }
+
+    std::tuple<T, bool> pop() {
+        std::tuple<T, bool> ret {};
+        std::get<1>(ret) = pop(std::get<0>(ret));
         return ret;
     }
 };
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+
+#include "queue_spsc.h"
+#include "queue_stats.h"
+
+namespace mpsc {
+
+/*
+ * The link an element embeds to sit in a queue: derive from it.
+ * An element in several queues at once derives from one hook per queue, each with its own Tag.
+*/
+template <typename Tag = void>
+struct basic_hook {
+    std::atomic<basic_hook*> next_ { nullptr };
+};
+
+using hook = basic_hook<>;
+
+/*
+ * Intrusive multi-producer, single-consumer queue.
+ *
+ * The queue links elements the caller owns, through the basic_hook<Tag> they derive from,
+ * so it never allocates. A push is a single exchange on the tail (wait-free),
+ * a pop is plain loads and stores, no CAS, and only the consumer may call it.
+ *
+ * An element belongs to the queue from its push until it comes out of pop(),
+ * it must stay alive and not be pushed again meanwhile. The queue doesn't own elements,
+ * anything left in it when it dies is just forgotten.
+ *
+ * A producer that has swapped the tail but not linked its element yet hides it and
+ * every element pushed after it: pop() returns nullptr until the link is made,
+ * so a consumer should check again rather than take nullptr as empty for good.
+ *
+ * Intrusive MPSC node-based queue - Dmitry Vyukov
+ * https://www.1024cores.net/home/lock-free-algorithms/queues/intrusive-mpsc-node-based-queue
+*/
+template <typename T, typename Tag = void, typename Stats = stats::none>
+class queue : protected Stats {
+public:
+    using value_type = T;
+    using hook_type  = basic_hook<Tag>;
+
+private:
+    alignas(spsc::cache_line_size) std::atomic<hook_type*>  tail_;       // producers
+    alignas(spsc::cache_line_size) hook_type*               head_;       // consumer, the next element to take
+    hook_type                                               stub_;       // stands in when there is no element
+    alignas(spsc::cache_line_size) std::atomic<std::size_t> live_ { 0 }; // only counted for Stats
+
+    void link(hook_type* n) {
+        n->next_.store(nullptr, std::memory_order_relaxed);
+        tail_.exchange(n, std::memory_order_acq_rel)
+            ->next_.store(n, std::memory_order_release);
+    }
+
+    T* take(hook_type* n) {
+        if constexpr (Stats::enabled) live_.fetch_sub(1, std::memory_order_relaxed);
+        return static_cast<T*>(n);
+    }
+
+public:
+    using Stats::stats;
+
+    queue()
+        : tail_(&stub_), head_(&stub_)
+    {}
+
+    queue(queue const &) = delete;
+    queue& operator=(queue const &) = delete;
+
+    void quit() {}
+
+    // Consumer only.
+    bool empty() const {
+        return (head_ == &stub_) &&
+               (stub_.next_.load(std::memory_order_acquire) == nullptr);
+    }
+
+    void push(T* elem) {
+        if constexpr (Stats::enabled) {
+            this->record_depth(live_.fetch_add(1, std::memory_order_relaxed) + 1);
+        }
+        link(static_cast<hook_type*>(elem));
+    }
+
+    // Consumer only, returns the oldest element, or nullptr (see above).
+    T* pop() {
+        auto head = head_;
+        auto next = head->next_.load(std::memory_order_acquire);
+        if (head == &stub_) {
+            if (next == nullptr) {
+                this->record(stats::event::empty);
+                return nullptr;
+            }
+            head_ = head = next;
+            next  = next->next_.load(std::memory_order_acquire);
+        }
+        if (next != nullptr) {
+            head_ = next;
+            return take(head);
+        }
+        // head is the last linked element: unless a push is midway,
+        // put the stub behind it so it can be taken without leaving the list empty.
+        if (head != tail_.load(std::memory_order_acquire)) {
+            this->record(stats::event::empty);
+            return nullptr;
+        }
+        link(&stub_);
+        next = head->next_.load(std::memory_order_acquire);
+        if (next != nullptr) {
+            head_ = next;
+            return take(head);
+        }
+        this->record(stats::event::empty);
+        return nullptr;
+    }
+
+    T* try_pop() {
+        return pop();
+    }
+};
+
+} // namespace mpsc
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <atomic>
+#include <tuple>
+#include <utility>
+#include <cstdint>
+#include <cstddef>
+
+#if defined(_MSC_VER)
+#   include <intrin.h>
+#endif
+
+namespace priority {
+namespace detail {
+
+inline unsigned lowest_bit(std::uint64_t m) noexcept {
+#if defined(__GNUC__) || defined(__clang__)
+    return static_cast<unsigned>(__builtin_ctzll(m));
+#elif defined(_MSC_VER) && defined(_M_X64)
+    unsigned long i;
+    _BitScanForward64(&i, m);
+    return static_cast<unsigned>(i);
+#else
+    unsigned i = 0;
+    while ((m & 1) == 0) { m >>= 1; ++i; }
+    return i;
+#endif
+}
+
+} // namespace detail
+
+/*
+ * Levels lanes of the non-blocking queue Q, lane 0 first.
+ *
+ * pop() takes from the most urgent lane that has data. A bitmap of lanes that may have data
+ * spares consumers from probing empty lanes: a producer sets its bit when it finds it clear,
+ * a consumer clears a bit when it finds the lane empty and then checks the lane once more,
+ * so an element pushed in between is never stranded behind a clear bit.
+*/
+template <typename Q, std::size_t Levels>
+class queue {
+    static_assert((Levels > 0) && (Levels <= 64), "A priority queue has 1 to 64 levels.");
+
+public:
+    using value_type = typename Q::value_type;
+
+    enum : std::size_t {
+        levels = Levels
+    };
+
+private:
+    alignas(64) std::atomic<std::uint64_t> mask_ { 0 };
+    Q lanes_[Levels];
+
+    void mark(std::size_t level) {
+        auto bit = std::uint64_t(1) << level;
+        // orders the push before reading the bit, against the clear-then-check in pop()
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if ((mask_.load(std::memory_order_relaxed) & bit) == 0) {
+            mask_.fetch_or(bit, std::memory_order_release);
+        }
+    }
+
+public:
+    void quit() {
+        for (auto& q : lanes_) q.quit();
+    }
+
+    bool empty() const {
+        return mask_.load(std::memory_order_acquire) == 0;
+    }
+
+    template <typename... P>
+    bool emplace(std::size_t level, P&&... pars) {
+        if (!lanes_[level].emplace(std::forward<P>(pars)...)) {
+            return false;
+        }
+        mark(level);
+        return true;
+    }
+
+    bool push(std::size_t level, value_type const & val) {
+        return emplace(level, val);
+    }
+
+    bool push(std::size_t level, value_type&& val) {
+        return emplace(level, std::move(val));
+    }
+
+    // Without a level, elements go to the least urgent lane.
+    bool push(value_type const & val) {
+        return emplace(Levels - 1, val);
+    }
+
+    bool push(value_type&& val) {
+        return emplace(Levels - 1, std::move(val));
+    }
+
+    bool pop(value_type& val) {
+        while (1) {
+            auto m = mask_.load(std::memory_order_acquire);
+            if (m == 0) {
+                return false;
+            }
+            auto level = detail::lowest_bit(m);
+            if (lanes_[level].try_pop(val)) {
+                return true;
+            }
+            auto bit = std::uint64_t(1) << level;
+            mask_.fetch_and(~bit, std::memory_order_seq_cst);
+            if (lanes_[level].try_pop(val)) {
+                mask_.fetch_or(bit, std::memory_order_relaxed); // there may be more behind it
+                return true;
+            }
+        }
+    }
+
+    bool try_pop(value_type& val) {
+        return pop(val);
+    }
+
+    std::tuple<value_type, bool> pop() {
+        std::tuple<value_type, bool> ret {};
+        std::get<1>(ret) = pop(std::get<0>(ret));
+        return ret;
+    }
+};
+
+} // namespace priority
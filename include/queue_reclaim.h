@@ -0,0 +1,243 @@
+#pragma once
+
+#include <atomic>
+#include <algorithm>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+namespace reclaim {
+
+/*
+ * Epoch-based reclamation.
+ *
+ * Threads touch shared nodes only inside a guard. Memory handed to retire() is
+ * released after every thread that was inside a guard at that time has left it,
+ * which takes two advances of the global epoch.
+ *
+ * Entering the outermost guard costs a store and a fence, nested guards are free.
+ * retire() is expected to be rare (once per batch of nodes), it takes a lock.
+*/
+class domain {
+
+    struct alignas(64) record {
+        std::atomic<std::uint64_t> state_  { 0 };     // (epoch << 1) | 1 while inside a guard
+        std::atomic<bool>          in_use_ { true };
+        record*                    next_   { nullptr };
+    };
+
+    struct retired {
+        void*          owner_;
+        void*          ptr_;
+        void         (*del_)(void*, void*);
+        std::uint64_t  epoch_;
+    };
+
+    struct local {
+        record*  rec_   = nullptr;
+        unsigned depth_ = 0;
+
+        ~local() {
+            if (rec_ != nullptr) {
+                rec_->state_.store(0, std::memory_order_release);
+                rec_->in_use_.store(false, std::memory_order_release);
+            }
+        }
+    };
+
+    std::atomic<std::uint64_t> epoch_   { 0 };
+    std::atomic<record*>       records_ { nullptr };
+
+    std::mutex           lock_;
+    std::vector<retired> retired_;
+    std::vector<void*>   busy_;     // one owner per entry taken out of retired_ and not released yet
+
+    static local& this_thread() {
+        thread_local local loc;
+        return loc;
+    }
+
+    record* acquire() {
+        for (auto r = records_.load(std::memory_order_acquire); r != nullptr; r = r->next_) {
+            bool expected = false;
+            if (!r->in_use_.load(std::memory_order_relaxed) &&
+                 r->in_use_.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+                return r;
+            }
+        }
+        auto r = new record;
+        r->next_ = records_.load(std::memory_order_relaxed);
+        while (!records_.compare_exchange_weak(r->next_, r, std::memory_order_release)) ;
+        return r;
+    }
+
+    bool try_advance() {
+        auto curr = epoch_.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        for (auto r = records_.load(std::memory_order_acquire); r != nullptr; r = r->next_) {
+            auto s = r->state_.load(std::memory_order_acquire);
+            if ((s & 1) && ((s >> 1) != curr)) {
+                return false; // someone is still inside an older epoch
+            }
+        }
+        return epoch_.compare_exchange_strong(curr, curr + 1, std::memory_order_seq_cst);
+    }
+
+    static void release(std::vector<retired>& list) {
+        for (auto& r : list) r.del_(r.owner_, r.ptr_);
+        list.clear();
+    }
+
+    bool busy(void* owner) {
+        return std::find(busy_.begin(), busy_.end(), owner) != busy_.end();
+    }
+
+    // Releases the entries collect() has marked busy, then clears their marks.
+    void release_busy(std::vector<retired>& list) {
+        if (list.empty()) return;
+        for (auto& r : list) r.del_(r.owner_, r.ptr_);
+        auto guard = std::unique_lock { lock_ };
+        for (auto& r : list) {
+            busy_.erase(std::find(busy_.begin(), busy_.end(), r.owner_));
+        }
+        list.clear();
+    }
+
+    domain() = default;
+
+public:
+    // One domain per process, the thread records are shared by every user.
+    static domain& instance() {
+        static domain dom;
+        return dom;
+    }
+
+    ~domain() {
+        release(retired_);
+        auto r = records_.load(std::memory_order_relaxed);
+        while (r != nullptr) {
+            auto temp = r->next_;
+            delete r;
+            r = temp;
+        }
+    }
+
+    void enter() {
+        auto& loc = this_thread();
+        if (loc.depth_++ != 0) return;
+        if (loc.rec_ == nullptr) {
+            loc.rec_ = acquire();
+        }
+        loc.rec_->state_.store((epoch_.load(std::memory_order_relaxed) << 1) | 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+
+    void leave() {
+        auto& loc = this_thread();
+        if (--loc.depth_ != 0) return;
+        loc.rec_->state_.store(0, std::memory_order_release);
+    }
+
+    /*
+     * Calls del(owner, p) once no guard that might still see p is left.
+     * drain(owner) calls it right away.
+    */
+    void retire(void* owner, void* p, void (*del)(void*, void*)) {
+        {
+            auto guard = std::unique_lock { lock_ };
+            retired_.push_back({ owner, p, del, epoch_.load(std::memory_order_seq_cst) });
+        }
+        collect();
+    }
+
+    // Releases whatever has been retired long enough ago.
+    void collect() {
+        try_advance();
+        std::vector<retired> ready;
+        {
+            auto guard = std::unique_lock { lock_ };
+            auto curr = epoch_.load(std::memory_order_acquire);
+            std::size_t k = 0;
+            for (auto& r : retired_) {
+                if (r.epoch_ + 2 <= curr) {
+                    ready.push_back(r);
+                    busy_.push_back(r.owner_);
+                }
+                else retired_[k++] = r;
+            }
+            retired_.resize(k);
+        }
+        release_busy(ready);
+    }
+
+    /*
+     * Waits until everything owner has retired is released, advancing the epoch
+     * as fast as the guards of other threads let it.
+     * Entries another thread's collect() is releasing count as well.
+     * Inside a guard of its own it would wait for good, so there it only collects once.
+    */
+    void synchronize(void* owner) {
+        if (this_thread().depth_ != 0) {
+            collect();
+            return;
+        }
+        while (1) {
+            collect();
+            {
+                auto guard = std::unique_lock { lock_ };
+                if (!busy(owner) &&
+                    std::none_of(retired_.begin(), retired_.end(), [owner](retired const & r) { return r.owner_ == owner; })) {
+                    return;
+                }
+            }
+            std::this_thread::yield();
+        }
+    }
+
+    /*
+     * Releases everything retired by owner right away,
+     * and waits for the entries of owner that another thread's collect() is releasing.
+     * Only for an owner no other thread can reach anymore (e.g. in its destructor).
+    */
+    void drain(void* owner) {
+        std::vector<retired> ready;
+        {
+            auto guard = std::unique_lock { lock_ };
+            std::size_t k = 0;
+            for (auto& r : retired_) {
+                if (r.owner_ == owner) ready.push_back(r);
+                else                   retired_[k++] = r;
+            }
+            retired_.resize(k);
+        }
+        release(ready);
+        while (1) {
+            {
+                auto guard = std::unique_lock { lock_ };
+                if (!busy(owner)) return;
+            }
+            std::this_thread::yield();
+        }
+    }
+};
+
+class guard {
+    domain& dom_;
+
+public:
+    guard()
+        : dom_(domain::instance()) {
+        dom_.enter();
+    }
+
+    guard(guard const &) = delete;
+    guard& operator=(guard const &) = delete;
+
+    ~guard() {
+        dom_.leave();
+    }
+};
+
+} // namespace reclaim
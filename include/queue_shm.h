@@ -0,0 +1,192 @@
+#pragma once
+
+#include <atomic>
+#include <new>
+#include <utility>
+#include <algorithm>
+#include <iterator>
+#include <type_traits>
+#include <cstdint>
+#include <cstddef>
+#include <cerrno>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "queue_spsc.h"
+#include "queue_mpmc.h"
+#include "queue_wait.h"
+
+namespace shm {
+
+/*
+ * Which rings may live in memory shared by several processes:
+ * fixed capacity (the storage is inline, no pointers), trivially copyable elements,
+ * and no process-private wait (spin_park sleeps on a private futex).
+*/
+template <typename Q>
+struct is_shareable : std::false_type {};
+
+template <typename T, std::size_t N>
+struct is_shareable<spsc::qring<T, N>>
+    : std::bool_constant<(N != spsc::runtime_capacity) && std::is_trivially_copyable<T>::value> {};
+
+template <typename T, std::size_t N>
+struct is_shareable<spsc::qcache<T, N>>
+    : std::bool_constant<(N != spsc::runtime_capacity) && std::is_trivially_copyable<T>::value> {};
+
+template <typename T, std::size_t N>
+struct is_shareable<mpmc::qring2<T, N, wait_strategy::busy_spin>>
+    : std::bool_constant<(N != spsc::runtime_capacity) && std::is_trivially_copyable<T>::value> {};
+
+template <typename T, std::size_t N, unsigned SpinN>
+struct is_shareable<mpmc::qring2<T, N, wait_strategy::spin_yield<SpinN>>>
+    : std::bool_constant<(N != spsc::runtime_capacity) && std::is_trivially_copyable<T>::value> {};
+
+/*
+ * A ring placed in a POSIX shared memory object.
+ *
+ * create() makes a new object and constructs the ring in it, open() attaches to one made by create().
+ * Both return an empty ring on failure (check it with operator bool, errno tells why).
+ * open() also fails on an object made for a different layout, or one whose creator hasn't finished yet,
+ * the caller may retry.
+ *
+ * The name stays in the system until remove(), the ring itself lives as long as anyone maps it.
+*/
+template <typename Q>
+class ring {
+    static_assert(is_shareable<Q>::value, "This queue can't be placed in shared memory.");
+    static_assert(std::atomic<std::uint32_t>::is_always_lock_free &&
+                  std::atomic<std::uint64_t>::is_always_lock_free,
+                  "Atomics in shared memory have to be lock-free.");
+
+    enum : std::uint32_t {
+        magic   = 0x5146534c, // "LSFQ"
+        version = 1
+    };
+
+    struct header {
+        std::uint32_t              magic_;
+        std::uint32_t              version_;
+        std::uint64_t              size_;      // of the whole mapping
+        std::uint64_t              layout_[4]; // sizeof(Q), alignof(Q), capacity, sizeof(value_type)
+        std::atomic<std::uint32_t> ready_;
+    };
+
+    enum : std::size_t {
+        que_offset = (sizeof(header) + alignof(Q) - 1) / alignof(Q) * alignof(Q),
+        total_size = que_offset + sizeof(Q)
+    };
+
+    void*  mem_ = nullptr;
+    Q*     que_ = nullptr;
+
+    static void layout(std::uint64_t (&out)[4]) {
+        out[0] = sizeof(Q);
+        out[1] = alignof(Q);
+        out[2] = Q::capacity();
+        out[3] = sizeof(typename Q::value_type);
+    }
+
+    static void* map(int fd) {
+        auto mem = ::mmap(nullptr, total_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        return (mem == MAP_FAILED) ? nullptr : mem;
+    }
+
+    header* head() const {
+        return static_cast<header*>(mem_);
+    }
+
+    ring(void* mem)
+        : mem_(mem)
+        , que_(reinterpret_cast<Q*>(static_cast<char*>(mem) + que_offset))
+    {}
+
+public:
+    ring() = default;
+
+    ring(ring&& other) noexcept
+        : mem_(std::exchange(other.mem_, nullptr))
+        , que_(std::exchange(other.que_, nullptr))
+    {}
+
+    ring& operator=(ring&& other) noexcept {
+        ring { std::move(other) }.swap(*this);
+        return *this;
+    }
+
+    ring(ring const &) = delete;
+    ring& operator=(ring const &) = delete;
+
+    ~ring() {
+        if (mem_ != nullptr) ::munmap(mem_, total_size);
+    }
+
+    void swap(ring& other) noexcept {
+        std::swap(mem_, other.mem_);
+        std::swap(que_, other.que_);
+    }
+
+    // Fails if the name already exists.
+    static ring create(char const * name) {
+        int fd = ::shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+        if (fd < 0) return {};
+        void* mem = nullptr;
+        if (::ftruncate(fd, static_cast<off_t>(total_size)) == 0) {
+            mem = map(fd);
+        }
+        ::close(fd);
+        if (mem == nullptr) {
+            ::shm_unlink(name);
+            return {};
+        }
+        auto hd = ::new (mem) header {};
+        hd->magic_   = magic;
+        hd->version_ = version;
+        hd->size_    = total_size;
+        layout(hd->layout_);
+        ::new (static_cast<char*>(mem) + que_offset) Q;
+        hd->ready_.store(1, std::memory_order_release);
+        return ring { mem };
+    }
+
+    static ring open(char const * name) {
+        int fd = ::shm_open(name, O_RDWR, 0600);
+        if (fd < 0) return {};
+        struct stat st;
+        void* mem = nullptr;
+        if ((::fstat(fd, &st) == 0) && (static_cast<std::size_t>(st.st_size) == total_size)) {
+            mem = map(fd);
+        }
+        else errno = EINVAL;
+        ::close(fd);
+        if (mem == nullptr) return {};
+        ring ret { mem };
+        std::uint64_t lay[4];
+        layout(lay);
+        auto hd = ret.head();
+        if ((hd->ready_.load(std::memory_order_acquire) != 1) ||
+            (hd->magic_ != magic) || (hd->version_ != version) || (hd->size_ != total_size) ||
+            !std::equal(std::begin(lay), std::end(lay), std::begin(hd->layout_))) {
+            errno = EPROTO;
+            return {};
+        }
+        return ret;
+    }
+
+    static bool remove(char const * name) {
+        return ::shm_unlink(name) == 0;
+    }
+
+    explicit operator bool() const noexcept {
+        return que_ != nullptr;
+    }
+
+    Q* get()        const noexcept { return  que_; }
+    Q* operator->() const noexcept { return  que_; }
+    Q& operator* () const noexcept { return *que_; }
+};
+
+} // namespace shm
@@ -4,10 +4,33 @@
 #include <new>
 #include <utility>
 #include <limits>
+#include <memory>
 #include <tuple>
 #include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+#include "queue_stats.h"
 
 namespace spsc {
+namespace detail {
+
+/*
+ * Builds a T from pars: with parentheses when T has a matching constructor, with braces otherwise,
+ * so an aggregate can be emplaced from its members (C++17 has no parenthesized aggregate init).
+ * The result is a prvalue, it initializes whatever it is assigned to in place.
+*/
+template <typename T, typename... P>
+T make(P&&... pars) {
+    if constexpr (std::is_constructible<T, P&&...>::value) {
+        return T(std::forward<P>(pars)...);
+    }
+    else {
+        return T { std::forward<P>(pars)... };
+    }
+}
+
+} // namespace detail
 
 template <typename T>
 class pool {
@@ -15,17 +38,39 @@ class pool {
     union node {
         T data_;
         std::atomic<node*> next_;
+
+        ~node() {}
     };
 
     std::atomic<node*> cursor_ { nullptr };
     std::atomic<node*> el_     { nullptr };
 
+    // raw storage, data_ is constructed by alloc()
+    static node* make_node() {
+        return static_cast<node*>(::operator new(sizeof(node), std::align_val_t { alignof(node) }));
+    }
+
+    static void drop_node(node* p) {
+        ::operator delete(p, std::align_val_t { alignof(node) });
+    }
+
+    void push_free(node* temp) {
+        auto curr = cursor_.load(std::memory_order_relaxed);
+        while (1) {
+            temp->next_.store(curr, std::memory_order_relaxed);
+            if (cursor_.compare_exchange_weak(curr, temp, std::memory_order_release)) {
+                break;
+            }
+        }
+    }
+
 public:
     ~pool() {
+        if (auto p = el_.load(std::memory_order_relaxed)) drop_node(p);
         auto curr = cursor_.load(std::memory_order_relaxed);
         while (curr != nullptr) {
             auto temp = curr->next_.load(std::memory_order_relaxed);
-            delete curr;
+            drop_node(curr);
             curr = temp;
         }
     }
@@ -34,13 +79,18 @@ public:
         return cursor_.load(std::memory_order_acquire) == nullptr;
     }
 
+    // Puts n free nodes in the pool up front, so the first n allocs don't hit the heap.
+    void reserve(std::size_t n) {
+        for (; n > 0; --n) push_free(make_node());
+    }
+
     template <typename... P>
     T* alloc(P&&... pars) {
         auto curr = el_.exchange(nullptr, std::memory_order_relaxed);
         if (curr == nullptr) {
             curr = cursor_.load(std::memory_order_acquire);
             if (curr == nullptr) {
-                return &((new node { std::forward<P>(pars)... })->data_);
+                return ::new (&(make_node()->data_)) T { std::forward<P>(pars)... };
             }
             while (1) {
                 auto next = curr->next_.load(std::memory_order_relaxed);
@@ -56,81 +106,335 @@ public:
         if (p == nullptr) return;
         auto temp = reinterpret_cast<node*>(p);
         temp = el_.exchange(temp, std::memory_order_relaxed);
-        if (temp == nullptr) {
-            return;
-        }
-        auto curr = cursor_.load(std::memory_order_relaxed);
-        while (1) {
-            temp->next_.store(curr, std::memory_order_relaxed);
-            if (cursor_.compare_exchange_weak(curr, temp, std::memory_order_release)) {
-                break;
-            }
+        if (temp != nullptr) {
+            push_free(temp);
         }
     }
 };
 
-template <typename T>
-class queue {
+// With a Stats policy other than stats::none, the queue counts its live elements even without a cap.
+template <typename T, typename Stats = stats::none>
+class queue : protected Stats {
 
     struct node {
         T data_;
-        std::atomic<node*> next_;
-    } dummy_ { {}, nullptr };
+        std::atomic<node*> next_ { nullptr };
+
+        template <typename... P>
+        node(P&&... pars)
+            : data_(detail::make<T>(std::forward<P>(pars)...))
+        {}
+    } dummy_;
 
     node* head_ { &dummy_ };
     node* tail_ { &dummy_ };
 
     pool<node> allocator_;
 
+    std::size_t const        cap_  = 0; // 0: no limit
+    std::atomic<std::size_t> live_ { 0 };
+
+    void destroy(node* p) {
+        if (p != &dummy_) {
+            p->~node();
+            allocator_.free(p);
+        }
+    }
+
+    bool count_push() {
+        if ((cap_ == 0) && !Stats::enabled) return true;
+        auto n = live_.fetch_add(1, std::memory_order_relaxed);
+        if ((cap_ != 0) && (n >= cap_)) {
+            live_.fetch_sub(1, std::memory_order_relaxed);
+            this->record(stats::event::full);
+            return false;
+        }
+        this->record_depth(n + 1);
+        return true;
+    }
+
+    void count_pop() {
+        if ((cap_ != 0) || Stats::enabled) live_.fetch_sub(1, std::memory_order_relaxed);
+    }
+
 public:
+    using value_type = T;
+
+    using Stats::stats;
+
+    queue() = default;
+
+    /*
+     * Pre-allocates reserve_n nodes.
+     * With a non-zero cap, pushes fail while cap elements are in the queue.
+    */
+    explicit queue(std::size_t reserve_n, std::size_t cap = 0)
+        : cap_(cap) {
+        reserve(reserve_n);
+    }
+
+    ~queue() {
+        while (head_ != nullptr) {
+            auto temp = head_;
+            head_ = head_->next_.load(std::memory_order_relaxed);
+            destroy(temp);
+        }
+    }
+
     void quit() {}
 
+    void reserve(std::size_t n) {
+        allocator_.reserve(n);
+    }
+
     bool empty() const {
         return head_->next_.load(std::memory_order_relaxed) == nullptr;
     }
 
-    bool push(T const & val) {
-        auto p = allocator_.alloc(val, nullptr);
+    template <typename... P>
+    bool emplace(P&&... pars) {
+        if (!count_push()) {
+            return false;
+        }
+        auto p = allocator_.alloc(std::forward<P>(pars)...);
         tail_->next_.store(p, std::memory_order_release);
         tail_ = p;
         return true;
     }
 
-    std::tuple<T, bool> pop() {
+    bool push(T const & val) {
+        return emplace(val);
+    }
+
+    bool push(T&& val) {
+        return emplace(std::move(val));
+    }
+
+    bool pop(T& val) {
         auto curr = head_;
         auto next = curr->next_.load(std::memory_order_acquire);
         if (next == nullptr) {
-            return {};
+            this->record(stats::event::empty);
+            return false;
         }
         head_ = next;
-        if (curr != &dummy_) {
-            allocator_.free(curr);
-        }
-        return std::make_tuple(next->data_, true);
+        destroy(curr);
+        // next is the new dummy node, its data is only destroyed when the node is recycled
+        val = std::move(next->data_);
+        count_pop();
+        return true;
+    }
+
+    bool try_pop(T& val) {
+        return pop(val);
+    }
+
+    std::tuple<T, bool> pop() {
+        std::tuple<T, bool> ret {};
+        std::get<1>(ret) = pop(std::get<0>(ret));
+        return ret;
+    }
+};
+
+enum : std::size_t {
+    cache_line_size  = 64,
+    default_capacity = 256,
+    runtime_capacity = 0    // capacity is chosen at construction, storage lives on the heap
+};
+
+namespace detail {
+
+constexpr bool is_pow2(std::size_t n) noexcept {
+    return (n != 0) && ((n & (n - 1)) == 0);
+}
+
+constexpr std::size_t ceil_pow2(std::size_t n) noexcept {
+    std::size_t r = 1;
+    while (r < n) r <<= 1;
+    return r;
+}
+
+/*
+ * Stores an element into a slot that is already alive.
+ * A single argument of the element type is assigned directly, anything else
+ * builds a temporary first.
+*/
+template <typename T, typename... P>
+void assign(T& slot, P&&... pars) {
+    if constexpr ((sizeof...(P) == 1) && (std::is_same<std::decay_t<P>, T>::value && ...)) {
+        ((slot = std::forward<P>(pars)), ...);
+    }
+    else {
+        slot = make<T>(std::forward<P>(pars)...);
+    }
+}
+
+/*
+ * Raw storage for one element of a ring.
+ * The element only lives between push and pop: construct() builds it in place, destroy() ends it.
+ * So an empty ring holds no objects at all, a popped element is released right away,
+ * and T needs no default constructor.
+ * For a trivially copyable T this compiles down to the same copies as a plain T.
+*/
+template <typename T>
+class slot {
+    alignas(T) unsigned char data_[sizeof(T)];
+
+public:
+    template <typename... P>
+    T* construct(P&&... pars) {
+        return ::new (static_cast<void*>(data_)) T(make<T>(std::forward<P>(pars)...));
     }
+
+    // Default-initialized, so a trivial T is left as it is.
+    T* construct_default() {
+        return ::new (static_cast<void*>(data_)) T;
+    }
+
+    void destroy() noexcept {
+        if constexpr (!std::is_trivially_destructible<T>::value) get().~T();
+    }
+
+    T&       get()       noexcept { return *std::launder(reinterpret_cast<T*      >(data_)); }
+    T const& get() const noexcept { return *std::launder(reinterpret_cast<T const*>(data_)); }
 };
 
+/*
+ * The rings are written against these, so a slot may be either a detail::slot<T>,
+ * or a plain T that stays alive as long as the ring does.
+ * The latter is for rings whose consumers copy an element before they know they own it
+ * (spmc::qring and the rings built on it), there is no point at which it could be destroyed.
+*/
+
+template <typename S, typename... P>
+void construct(S& s, P&&... pars) {
+    assign(s, std::forward<P>(pars)...);
+}
+
+template <typename T, typename... P>
+void construct(slot<T>& s, P&&... pars) {
+    s.construct(std::forward<P>(pars)...);
+}
+
+template <typename S>
+S* construct_default(S& s) noexcept {
+    return &s;
+}
+
 template <typename T>
-class qring {
+T* construct_default(slot<T>& s) {
+    return s.construct_default();
+}
+
+template <typename S>
+void destroy(S&) noexcept {}
+
+template <typename T>
+void destroy(slot<T>& s) noexcept {
+    s.destroy();
+}
+
+template <typename S>
+S& element(S& s) noexcept {
+    return s;
+}
+
+template <typename T>
+T& element(slot<T>& s) noexcept {
+    return s.get();
+}
+
+template <typename T, std::size_t N>
+class ring_storage {
+    static_assert(is_pow2(N), "The capacity of a ring must be a power of two.");
+    static_assert(N <= (std::size_t(1) << 31), "The capacity of a ring is too large.");
+
 public:
-    using ei_t = std::uint8_t;
+    using ei_t = std::uint32_t;
     using ti_t = std::uint32_t;
 
     enum : std::size_t {
-        elem_max = (std::numeric_limits<ei_t>::max)() + 1, // 255 + 1
+        elem_max = N
     };
 
 protected:
     T block_[elem_max];
 
+    constexpr static ei_t index_of(ti_t index) noexcept {
+        return static_cast<ei_t>(index & (elem_max - 1));
+    }
+
+public:
+    constexpr static std::size_t capacity() noexcept {
+        return elem_max;
+    }
+};
+
+template <typename T>
+class ring_storage<T, runtime_capacity> {
+public:
+    using ei_t = std::uint32_t;
+    using ti_t = std::uint32_t;
+
+protected:
+    ti_t mask_;
+    std::unique_ptr<T[]> block_;
+
+    ei_t index_of(ti_t index) const noexcept {
+        return static_cast<ei_t>(index & mask_);
+    }
+
+public:
+    explicit ring_storage(std::size_t n)
+        : mask_ (static_cast<ti_t>(ceil_pow2((n < 2) ? 2 : n) - 1))
+        , block_(new T[capacity()])
+    {}
+
+    std::size_t capacity() const noexcept {
+        return static_cast<std::size_t>(mask_) + 1;
+    }
+};
+
+} // namespace detail
+
+/*
+ * Stats is the statistics policy (see queue_stats.h), it is shared with the rings built on this one.
+ * S is the slot type: detail::slot<T> by default, so elements are built on push and destroyed on pop,
+ * or T itself for derived rings that need every slot alive (see detail::construct).
+*/
+template <typename T, std::size_t N = default_capacity,
+          typename Stats = stats::none, typename S = detail::slot<T>>
+class qring : public detail::ring_storage<S, N>, protected Stats {
+    using base_t = detail::ring_storage<S, N>;
+
+public:
+    using value_type = T;
+
+    using typename base_t::ei_t;
+    using typename base_t::ti_t;
+
+    using base_t::base_t;
+
+    using Stats::stats;
+
+protected:
+    using base_t::block_;
+    using base_t::index_of;
+
     std::atomic<ti_t> rd_ { 0 }; // read index
     std::atomic<ti_t> wt_ { 0 }; // write index
 
-    constexpr static ei_t index_of(ti_t index) noexcept {
-        return static_cast<ei_t>(index);
+public:
+    // Only a detail::slot<T> holds anything to destroy, derived rings with other slots clean up on their own.
+    ~qring() {
+        if constexpr (std::is_same<S, detail::slot<T>>::value) {
+            auto cur_wt = wt_.load(std::memory_order_relaxed);
+            for (auto i = rd_.load(std::memory_order_relaxed); i != cur_wt; ++i) {
+                detail::destroy(block_[index_of(i)]);
+            }
+        }
     }
 
-public:
     void quit() {}
 
     bool empty() const {
@@ -138,25 +442,414 @@ public:
                index_of(wt_.load(std::memory_order_acquire));
     }
 
-    bool push(T const & val) {
-        auto id_wt = index_of(wt_.load(std::memory_order_relaxed));
-        if (id_wt == index_of(rd_.load(std::memory_order_acquire) - 1)) {
-            return false; // full
+    bool full() const {
+        return index_of(wt_.load(std::memory_order_relaxed)) ==
+               index_of(rd_.load(std::memory_order_acquire) - 1);
+    }
+
+    template <typename... P>
+    bool emplace(P&&... pars) {
+        auto cur_wt = wt_.load(std::memory_order_relaxed);
+        auto cur_rd = rd_.load(std::memory_order_acquire);
+        auto id_wt  = index_of(cur_wt);
+        if (id_wt == index_of(cur_rd - 1)) {
+            this->record(stats::event::full);
+            return false;
         }
-        block_[id_wt] = val;
+        detail::construct(block_[id_wt], std::forward<P>(pars)...);
         wt_.fetch_add(1, std::memory_order_release);
+        this->record_depth(static_cast<ti_t>(cur_wt + 1 - cur_rd));
         return true;
     }
 
+    template <typename... P>
+    bool try_emplace(P&&... pars) {
+        return emplace(std::forward<P>(pars)...);
+    }
+
+    bool push(T const & val) {
+        return emplace(val);
+    }
+
+    bool push(T&& val) {
+        return emplace(std::move(val));
+    }
+
+    bool pop(T& val) {
+        auto id_rd = index_of(rd_.load(std::memory_order_relaxed));
+        if (id_rd == index_of(wt_.load(std::memory_order_acquire))) {
+            this->record(stats::event::empty);
+            return false;
+        }
+        val = std::move(detail::element(block_[id_rd]));
+        detail::destroy(block_[id_rd]);
+        rd_.fetch_add(1, std::memory_order_release);
+        return true;
+    }
+
+    bool try_pop(T& val) {
+        return pop(val);
+    }
+
     std::tuple<T, bool> pop() {
+        std::tuple<T, bool> ret {};
+        std::get<1>(ret) = pop(std::get<0>(ret));
+        return ret;
+    }
+
+    /*
+     * Zero-copy interface.
+     * claim_push() default-initializes the element in the next free slot and hands it out
+     * (nullptr if full), it is filled in place and becomes visible to the consumer on publish().
+     * claim_pop() hands out the oldest element in place (nullptr if empty), it is destroyed
+     * and the slot recycled on release().
+    */
+
+    T* claim_push() {
+        auto cur_wt = wt_.load(std::memory_order_relaxed);
+        auto cur_rd = rd_.load(std::memory_order_acquire);
+        auto id_wt  = index_of(cur_wt);
+        if (id_wt == index_of(cur_rd - 1)) {
+            this->record(stats::event::full);
+            return nullptr;
+        }
+        this->record_depth(static_cast<ti_t>(cur_wt + 1 - cur_rd));
+        return detail::construct_default(block_[id_wt]);
+    }
+
+    void publish() {
+        wt_.fetch_add(1, std::memory_order_release);
+    }
+
+    T* claim_pop() {
         auto id_rd = index_of(rd_.load(std::memory_order_relaxed));
         if (id_rd == index_of(wt_.load(std::memory_order_acquire))) {
-            return {}; // empty
+            this->record(stats::event::empty);
+            return nullptr;
         }
-        auto ret = std::make_tuple(block_[id_rd], true);
+        return &detail::element(block_[id_rd]);
+    }
+
+    void release() {
+        detail::destroy(block_[index_of(rd_.load(std::memory_order_relaxed))]);
         rd_.fetch_add(1, std::memory_order_release);
+    }
+};
+
+/*
+ * Same ring as qring, but the producer and the consumer each keep a private copy
+ * of the other side's index, and only reload the shared one when the ring looks
+ * full (or empty). Each side lives on its own cache line.
+ * The depth a push records is taken against the producer's copy, so the peak is an upper bound.
+*/
+template <typename T, std::size_t N = default_capacity, typename Stats = stats::none>
+class qcache : public detail::ring_storage<detail::slot<T>, N>, protected Stats {
+    using base_t = detail::ring_storage<detail::slot<T>, N>;
+
+public:
+    using value_type = T;
+
+    using typename base_t::ei_t;
+    using typename base_t::ti_t;
+
+    using base_t::base_t;
+
+    using Stats::stats;
+
+protected:
+    using base_t::block_;
+    using base_t::index_of;
+
+    alignas(cache_line_size) std::atomic<ti_t> wt_ { 0 }; // write index
+    ti_t rd_cache_ { 0 };                                  // producer's copy of rd_
+
+    alignas(cache_line_size) std::atomic<ti_t> rd_ { 0 }; // read index
+    ti_t wt_cache_ { 0 };                                  // consumer's copy of wt_
+
+public:
+    ~qcache() {
+        auto cur_wt = wt_.load(std::memory_order_relaxed);
+        for (auto i = rd_.load(std::memory_order_relaxed); i != cur_wt; ++i) {
+            block_[index_of(i)].destroy();
+        }
+    }
+
+    void quit() {}
+
+    bool empty() const {
+        return rd_.load(std::memory_order_relaxed) ==
+               wt_.load(std::memory_order_acquire);
+    }
+
+    template <typename... P>
+    bool emplace(P&&... pars) {
+        auto cur_wt = wt_.load(std::memory_order_relaxed);
+        if (static_cast<ti_t>(cur_wt - rd_cache_) == this->capacity()) {
+            rd_cache_ = rd_.load(std::memory_order_acquire);
+            if (static_cast<ti_t>(cur_wt - rd_cache_) == this->capacity()) {
+                this->record(stats::event::full);
+                return false;
+            }
+        }
+        block_[index_of(cur_wt)].construct(std::forward<P>(pars)...);
+        wt_.store(cur_wt + 1, std::memory_order_release);
+        this->record_depth(static_cast<ti_t>(cur_wt + 1 - rd_cache_));
+        return true;
+    }
+
+    bool push(T const & val) {
+        return emplace(val);
+    }
+
+    bool push(T&& val) {
+        return emplace(std::move(val));
+    }
+
+    bool pop(T& val) {
+        auto cur_rd = rd_.load(std::memory_order_relaxed);
+        if (cur_rd == wt_cache_) {
+            wt_cache_ = wt_.load(std::memory_order_acquire);
+            if (cur_rd == wt_cache_) {
+                this->record(stats::event::empty);
+                return false;
+            }
+        }
+        auto& item = block_[index_of(cur_rd)];
+        val = std::move(item.get());
+        item.destroy();
+        rd_.store(cur_rd + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool try_pop(T& val) {
+        return pop(val);
+    }
+
+    std::tuple<T, bool> pop() {
+        std::tuple<T, bool> ret {};
+        std::get<1>(ret) = pop(std::get<0>(ret));
         return ret;
     }
 };
 
+namespace detail {
+
+template <std::size_t N>
+class byte_storage {
+    static_assert(is_pow2(N), "The capacity of a byte ring must be a power of two.");
+    static_assert((N >= 64) && (N <= (std::size_t(1) << 31)), "The capacity of a byte ring is out of range.");
+
+protected:
+    alignas(std::uint64_t) unsigned char block_[N];
+
+    constexpr static std::uint32_t offset_of(std::uint32_t index) noexcept {
+        return static_cast<std::uint32_t>(index & (N - 1));
+    }
+
+    unsigned char* at(std::uint32_t index) noexcept {
+        return block_ + offset_of(index);
+    }
+
+public:
+    constexpr static std::size_t capacity() noexcept {
+        return N;
+    }
+};
+
+template <>
+class byte_storage<runtime_capacity> {
+protected:
+    std::uint32_t mask_;
+    std::unique_ptr<std::uint64_t[]> block_;
+
+    std::uint32_t offset_of(std::uint32_t index) const noexcept {
+        return static_cast<std::uint32_t>(index & mask_);
+    }
+
+    unsigned char* at(std::uint32_t index) noexcept {
+        return reinterpret_cast<unsigned char*>(block_.get()) + offset_of(index);
+    }
+
+public:
+    explicit byte_storage(std::size_t n)
+        : mask_ (static_cast<std::uint32_t>(ceil_pow2((n < 64) ? 64 : n) - 1))
+        , block_(new std::uint64_t[capacity() / sizeof(std::uint64_t)])
+    {}
+
+    std::size_t capacity() const noexcept {
+        return static_cast<std::size_t>(mask_) + 1;
+    }
+};
+
+} // namespace detail
+
+/*
+ * A ring of variable-length records, N bytes in all (a power of two, or runtime_capacity).
+ *
+ * The producer claims a contiguous region for a record, fills it in place and publishes it,
+ * the consumer reads records in place, so memory goes by the bytes actually sent
+ * instead of the largest record times the slot count.
+ * Like a bip-buffer, a record never wraps: one that doesn't fit before the end of the block
+ * leaves the rest of it as padding and starts over at the front.
+ *
+ * Each record takes an 8-byte header plus its size rounded up to 8, payloads are 8-byte aligned.
+ * A record may hold up to capacity() - header_size bytes.
+ * The depth a push records is in bytes, headers and padding included.
+*/
+template <std::size_t N = 65536, typename Stats = stats::none>
+class qbip : public detail::byte_storage<N>, protected Stats {
+    using base_t = detail::byte_storage<N>;
+
+public:
+    using ti_t = std::uint32_t;
+
+    enum : std::size_t {
+        header_size = 8
+    };
+
+    using base_t::base_t;
+
+    using Stats::stats;
+
+protected:
+    using base_t::at;
+    using base_t::offset_of;
+
+    enum : std::uint32_t {
+        padding = 0xffffffff // the size of a header that only skips to the end of the block
+    };
+
+    alignas(cache_line_size) std::atomic<ti_t> wt_ { 0 }; // write index, in bytes
+    ti_t rd_cache_ { 0 };                                  // producer's copy of rd_
+
+    alignas(cache_line_size) std::atomic<ti_t> rd_ { 0 }; // read index, in bytes
+    ti_t wt_cache_ { 0 };                                  // consumer's copy of wt_
+
+    constexpr static ti_t record_size(std::size_t n) noexcept {
+        return static_cast<ti_t>((header_size + n + 7) & ~std::size_t(7));
+    }
+
+    void write_header(ti_t index, std::uint32_t size) noexcept {
+        std::memcpy(at(index), &size, sizeof(size));
+    }
+
+    std::uint32_t read_header(ti_t index) noexcept {
+        std::uint32_t size;
+        std::memcpy(&size, at(index), sizeof(size));
+        return size;
+    }
+
+    // Whether n more bytes fit after cur_wt, reloading the consumer's index only when they don't.
+    bool fits(ti_t cur_wt, ti_t n) {
+        auto cap = static_cast<ti_t>(this->capacity());
+        if (static_cast<ti_t>(cur_wt + n - rd_cache_) <= cap) {
+            return true;
+        }
+        rd_cache_ = rd_.load(std::memory_order_acquire);
+        return static_cast<ti_t>(cur_wt + n - rd_cache_) <= cap;
+    }
+
+public:
+    void quit() {}
+
+    bool empty() const {
+        return rd_.load(std::memory_order_relaxed) ==
+               wt_.load(std::memory_order_acquire);
+    }
+
+    /*
+     * Zero-copy interface.
+     * claim_push() hands out n contiguous bytes for the next record (nullptr if there is no room yet),
+     * they become visible to the consumer on publish(size), size being at most the n claimed.
+     * claim_pop() hands out the oldest record and its size (nullptr if empty),
+     * its bytes are given back on release().
+    */
+
+    unsigned char* claim_push(std::size_t n) {
+        if (n > this->capacity() - header_size) {
+            return nullptr;
+        }
+        auto cur_wt = wt_.load(std::memory_order_relaxed);
+        auto need   = record_size(n);
+        auto tail   = static_cast<ti_t>(this->capacity() - offset_of(cur_wt));
+        if (need > tail) {
+            // Pad to the end of the block on its own, so the front frees up
+            // even if the record won't fit until the consumer has moved on.
+            if (!fits(cur_wt, tail)) {
+                this->record(stats::event::full);
+                return nullptr;
+            }
+            write_header(cur_wt, padding);
+            cur_wt += tail;
+            wt_.store(cur_wt, std::memory_order_release);
+        }
+        if (!fits(cur_wt, need)) {
+            this->record(stats::event::full);
+            return nullptr;
+        }
+        this->record_depth(static_cast<ti_t>(cur_wt + need - rd_cache_));
+        return at(cur_wt) + header_size;
+    }
+
+    void publish(std::size_t size) {
+        auto cur_wt = wt_.load(std::memory_order_relaxed);
+        write_header(cur_wt, static_cast<std::uint32_t>(size));
+        wt_.store(cur_wt + record_size(size), std::memory_order_release);
+    }
+
+    unsigned char* claim_pop(std::size_t& size) {
+        auto cur_rd = rd_.load(std::memory_order_relaxed);
+        while (1) {
+            if (cur_rd == wt_cache_) {
+                wt_cache_ = wt_.load(std::memory_order_acquire);
+                if (cur_rd == wt_cache_) {
+                    this->record(stats::event::empty);
+                    return nullptr;
+                }
+            }
+            auto hdr = read_header(cur_rd);
+            if (hdr != padding) {
+                size = hdr;
+                return at(cur_rd) + header_size;
+            }
+            cur_rd += static_cast<ti_t>(this->capacity() - offset_of(cur_rd));
+            rd_.store(cur_rd, std::memory_order_release);
+        }
+    }
+
+    void release() {
+        auto cur_rd = rd_.load(std::memory_order_relaxed);
+        rd_.store(cur_rd + record_size(read_header(cur_rd)), std::memory_order_release);
+    }
+
+    // Copies n bytes in as one record.
+    bool push(void const * data, std::size_t n) {
+        auto p = claim_push(n);
+        if (p == nullptr) {
+            return false;
+        }
+        if (n != 0) std::memcpy(p, data, n);
+        publish(n);
+        return true;
+    }
+
+    // Calls f(unsigned char const *, std::size_t) on the oldest record in place, then releases it.
+    template <typename F>
+    bool pop(F&& f) {
+        std::size_t size = 0;
+        auto p = claim_pop(size);
+        if (p == nullptr) {
+            return false;
+        }
+        std::forward<F>(f)(static_cast<unsigned char const *>(p), size);
+        release();
+        return true;
+    }
+
+    template <typename F>
+    bool try_pop(F&& f) {
+        return pop(std::forward<F>(f));
+    }
+};
+
 } // namespace spsc
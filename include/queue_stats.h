@@ -0,0 +1,177 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <utility>
+#include <type_traits>
+#include <cstdint>
+#include <cstddef>
+
+#include "queue_thread.h"
+
+namespace stats {
+
+enum class event : unsigned {
+    cas_retry,  // a CAS that lost a race and had to be retried
+    full,       // a push that found no room (failed, or had to wait)
+    empty,      // a pop that found nothing (failed, or had to wait)
+    yield,      // a failed check inside a wait strategy, each is followed by a pause, a yield or a park
+    pool_alloc, // a node taken from a pool
+    pool_free,  // a node given back to a pool
+    pool_heap   // a pool that had to go to the heap for more nodes
+};
+
+enum : std::size_t {
+    event_count = static_cast<std::size_t>(event::pool_heap) + 1
+};
+
+inline char const * name_of(event e) noexcept {
+    constexpr char const * names[event_count] = {
+        "cas_retry", "full", "empty", "yield", "pool_alloc", "pool_free", "pool_heap"
+    };
+    return names[static_cast<std::size_t>(e)];
+}
+
+// A snapshot of the counters of a queue.
+struct report {
+    std::uint64_t counts_[event_count] {};
+    std::uint64_t peak_depth_ = 0; // the most elements a push saw in the queue, itself included
+
+    std::uint64_t operator[](event e) const noexcept {
+        return counts_[static_cast<std::size_t>(e)];
+    }
+
+    report& operator+=(report const & other) noexcept {
+        for (std::size_t i = 0; i < event_count; ++i) counts_[i] += other.counts_[i];
+        if (other.peak_depth_ > peak_depth_) peak_depth_ = other.peak_depth_;
+        return *this;
+    }
+};
+
+/*
+ * Statistics policies.
+ *
+ * A queue takes one as its last template parameter and inherits from it,
+ * calls record()/record_depth() where something worth counting happens,
+ * waits through record_wait(), and hands out a snapshot with stats().
+ * Arguments that cost something to compute are guarded by the policy's enabled flag.
+*/
+
+/*
+ * Counts nothing. An empty base, so the queue keeps its size, and every call compiles to nothing.
+ * Tag only tells apart the policies of a queue and of an allocator at its start (see inner).
+*/
+template <typename Tag = void>
+class basic_none {
+public:
+    enum : bool {
+        enabled = false
+    };
+
+    void record(event, std::uint64_t = 1) noexcept {}
+    void record_depth(std::uint64_t) noexcept {}
+
+    template <typename W, typename F>
+    void record_wait(W& w, event, F&& pred) {
+        w.wait_until(std::forward<F>(pred));
+    }
+
+    report stats() const noexcept {
+        return {};
+    }
+};
+
+using none = basic_none<>;
+
+/*
+ * Counts into per-thread slots, each on its own cache line, so counting doesn't make the threads
+ * share any line they didn't share before. Threads beyond slot_count share slots,
+ * the counts stay exact since every update is atomic.
+ * stats() adds up the slots, it may miss what other threads are counting at the same time.
+*/
+class counters {
+    enum : std::size_t {
+        slot_count = 32
+    };
+
+    struct alignas(64) slot {
+        std::atomic<std::uint64_t> counts_[event_count] {};
+        std::atomic<std::uint64_t> peak_ { 0 };
+    };
+
+    std::unique_ptr<slot[]> slots_ { new slot[slot_count] };
+
+    slot& this_slot() const noexcept {
+        return slots_[thread_id::get() % slot_count];
+    }
+
+public:
+    enum : bool {
+        enabled = true
+    };
+
+    void record(event e, std::uint64_t n = 1) noexcept {
+        this_slot().counts_[static_cast<std::size_t>(e)].fetch_add(n, std::memory_order_relaxed);
+    }
+
+    void record_depth(std::uint64_t depth) noexcept {
+        auto& peak = this_slot().peak_;
+        auto curr = peak.load(std::memory_order_relaxed);
+        while ((depth > curr) && !peak.compare_exchange_weak(curr, depth, std::memory_order_relaxed)) ;
+    }
+
+    // A wait that doesn't succeed right away counts as e, and every failed check in it as a yield.
+    template <typename W, typename F>
+    void record_wait(W& w, event e, F&& pred) {
+        std::uint64_t rounds = 0;
+        w.wait_until([&] {
+            if (pred()) return true;
+            ++rounds;
+            return false;
+        });
+        if (rounds != 0) {
+            record(e);
+            record(event::yield, rounds);
+        }
+    }
+
+    report stats() const noexcept {
+        report ret;
+        for (std::size_t k = 0; k < slot_count; ++k) {
+            auto& s = slots_[k];
+            for (std::size_t i = 0; i < event_count; ++i) {
+                ret.counts_[i] += s.counts_[i].load(std::memory_order_relaxed);
+            }
+            auto peak = s.peak_.load(std::memory_order_relaxed);
+            if (peak > ret.peak_depth_) ret.peak_depth_ = peak;
+        }
+        return ret;
+    }
+};
+
+/*
+ * The policy for an object that sits at the start of another object with the same policy
+ * (the pool of mpmc::queue). Two empty bases of one type can't share an address,
+ * so with none the outer object would grow by a padded member.
+*/
+template <typename Stats>
+struct inner_of {
+    using type = Stats;
+};
+
+template <>
+struct inner_of<none> {
+    using type = basic_none<struct inner_tag>;
+};
+
+template <typename Stats>
+using inner = typename inner_of<Stats>::type;
+
+// Whether Q hands out a report, e.g. a pool inside a queue.
+template <typename Q, typename = void>
+struct has_stats : std::false_type {};
+
+template <typename Q>
+struct has_stats<Q, std::void_t<decltype(std::declval<Q const &>().stats())>> : std::true_type {};
+
+} // namespace stats
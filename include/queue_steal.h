@@ -0,0 +1,322 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <thread>
+#include <utility>
+#include <type_traits>
+#include <cstdint>
+#include <cstddef>
+
+#include "queue_mpmc.h"
+#include "queue_wait.h"
+
+namespace steal {
+
+/*
+ * Chase-Lev work-stealing deque.
+ *
+ * The owner thread pushes and pops at the bottom, any other thread steals from the top.
+ * The array doubles when full, the old ones are kept until the deque dies,
+ * since a thief may still be reading them.
+ * Thieves read an element before they know they won it, so T must be trivially copyable
+ * (task pointers, indices).
+ *
+ * Correct and Efficient Work-Stealing for Weak Memory Models - Nhat Minh Lê, Antoniu Pop, Albert Cohen, Francesco Zappa Nardelli
+ * https://fzn.fr/readings/ppopp13.pdf
+*/
+template <typename T>
+class deque {
+    static_assert(std::is_trivially_copyable<T>::value, "Thieves copy elements before winning them.");
+
+    struct array {
+        std::int64_t                      mask_;
+        std::unique_ptr<std::atomic<T>[]> buf_;
+
+        explicit array(std::int64_t n)
+            : mask_(n - 1), buf_(new std::atomic<T>[static_cast<std::size_t>(n)])
+        {}
+
+        std::int64_t size() const noexcept {
+            return mask_ + 1;
+        }
+
+        T get(std::int64_t i) const noexcept {
+            return buf_[static_cast<std::size_t>(i & mask_)].load(std::memory_order_relaxed);
+        }
+
+        void put(std::int64_t i, T val) noexcept {
+            buf_[static_cast<std::size_t>(i & mask_)].store(val, std::memory_order_relaxed);
+        }
+    };
+
+    alignas(spsc::cache_line_size) std::atomic<std::int64_t> top_    { 0 };
+    alignas(spsc::cache_line_size) std::atomic<std::int64_t> bottom_ { 0 };
+    std::atomic<array*> array_;
+
+    std::vector<std::unique_ptr<array>> arrays_; // owner only, the current one is the last
+
+    array* grow(array* a, std::int64_t b, std::int64_t t) {
+        auto bigger = std::make_unique<array>(a->size() * 2);
+        for (auto i = t; i < b; ++i) bigger->put(i, a->get(i));
+        auto p = bigger.get();
+        arrays_.push_back(std::move(bigger));
+        array_.store(p, std::memory_order_release);
+        return p;
+    }
+
+public:
+    using value_type = T;
+
+    explicit deque(std::size_t n = spsc::default_capacity) {
+        arrays_.push_back(std::make_unique<array>(static_cast<std::int64_t>(spsc::detail::ceil_pow2((n < 2) ? 2 : n))));
+        array_.store(arrays_.back().get(), std::memory_order_relaxed);
+    }
+
+    deque(deque const &) = delete;
+    deque& operator=(deque const &) = delete;
+
+    bool empty() const {
+        auto b = bottom_.load(std::memory_order_relaxed);
+        auto t = top_   .load(std::memory_order_relaxed);
+        return b <= t;
+    }
+
+    // Owner only.
+    void push(T val) {
+        auto b = bottom_.load(std::memory_order_relaxed);
+        auto t = top_   .load(std::memory_order_acquire);
+        auto a = array_ .load(std::memory_order_relaxed);
+        if (b - t > a->size() - 1) {
+            a = grow(a, b, t);
+        }
+        a->put(b, val);
+        bottom_.store(b + 1, std::memory_order_release);
+    }
+
+    // Owner only, takes the most recently pushed element.
+    bool pop(T& val) {
+        auto b = bottom_.load(std::memory_order_relaxed) - 1;
+        auto a = array_ .load(std::memory_order_relaxed);
+        bottom_.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        auto t = top_.load(std::memory_order_relaxed);
+        if (t > b) {
+            bottom_.store(b + 1, std::memory_order_relaxed); // empty
+            return false;
+        }
+        val = a->get(b);
+        if (t == b) {
+            // the last element, race the thieves for it
+            bool won = top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+            bottom_.store(b + 1, std::memory_order_relaxed);
+            return won;
+        }
+        return true;
+    }
+
+    // Any thread, takes the oldest element. May fail spuriously when racing with others.
+    bool steal(T& val) {
+        auto t = top_.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        auto b = bottom_.load(std::memory_order_acquire);
+        if (t >= b) {
+            return false;
+        }
+        auto a = array_.load(std::memory_order_acquire);
+        auto x = a->get(t);
+        if (!top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+            return false;
+        }
+        val = x;
+        return true;
+    }
+};
+
+// Counts outstanding tasks, see executor::wait().
+class wait_group {
+    friend class executor;
+    std::atomic<std::size_t> count_ { 0 };
+
+public:
+    bool done() const {
+        return count_.load(std::memory_order_acquire) == 0;
+    }
+};
+
+/*
+ * Work-stealing thread pool.
+ *
+ * Every worker owns a deque: tasks submitted by a worker go to its own bottom and it runs them LIFO,
+ * idle workers steal the oldest tasks of others. Tasks from other threads go through
+ * an mpmc::qring2 injection queue. Workers with nothing to do park on an eventcount,
+ * a submit costs a fence and a load unless one of them is asleep.
+ *
+ * wait() runs other tasks while it waits, so fork/join recursion doesn't block workers.
+*/
+class executor {
+
+    struct task {
+        void      (*run_)(task*);
+        wait_group* wg_;
+    };
+
+    template <typename F>
+    struct task_of : task {
+        F f_;
+
+        template <typename U>
+        task_of(U&& f, wait_group* wg)
+            : task { &task_of::invoke, wg }, f_(std::forward<U>(f))
+        {}
+
+        static void invoke(task* t) {
+            auto self = static_cast<task_of*>(t);
+            self->f_();
+            auto wg = self->wg_;
+            delete self;
+            if (wg != nullptr) wg->count_.fetch_sub(1, std::memory_order_acq_rel);
+        }
+    };
+
+    struct alignas(spsc::cache_line_size) worker {
+        deque<task*> dq_;
+        std::thread  th_;
+    };
+
+    std::vector<std::unique_ptr<worker>>  workers_;
+    mpmc::qring2<task*, 1024>             inject_;
+    wait_strategy::eventcount             ec_;
+    std::atomic<bool>                     stop_ { false };
+
+    struct local {
+        executor* ex_  = nullptr;
+        worker*   wk_  = nullptr;
+        unsigned  rnd_ = 0;
+    };
+
+    static local& this_thread() {
+        thread_local local loc;
+        return loc;
+    }
+
+    worker* self() const {
+        auto& loc = this_thread();
+        return (loc.ex_ == this) ? loc.wk_ : nullptr;
+    }
+
+    static unsigned next_random(unsigned& x) {
+        // xorshift32
+        if (x == 0) x = static_cast<unsigned>(reinterpret_cast<std::uintptr_t>(&x)) | 1;
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        return x;
+    }
+
+    task* find_task(worker* wk) {
+        task* t = nullptr;
+        if ((wk != nullptr) && wk->dq_.pop(t)) {
+            return t;
+        }
+        if (inject_.try_pop(t)) {
+            return t;
+        }
+        auto n = workers_.size();
+        auto start = next_random(this_thread().rnd_) % n;
+        for (std::size_t i = 0; i < n; ++i) {
+            auto victim = workers_[(start + i) % n].get();
+            if ((victim != wk) && victim->dq_.steal(t)) {
+                return t;
+            }
+        }
+        return nullptr;
+    }
+
+    void run(std::size_t index) {
+        auto& loc = this_thread();
+        loc.ex_ = this;
+        loc.wk_ = workers_[index].get();
+        while (1) {
+            task* t = nullptr;
+            for (unsigned k = 0; (k < 64) && ((t = find_task(loc.wk_)) == nullptr); ++k) {
+                wait_strategy::detail::cpu_pause();
+            }
+            if (t == nullptr) {
+                auto key = ec_.prepare_wait();
+                if ((t = find_task(loc.wk_)) != nullptr) {
+                    ec_.cancel_wait();
+                }
+                else if (stop_.load(std::memory_order_acquire)) {
+                    ec_.cancel_wait();
+                    break;
+                }
+                else {
+                    ec_.commit_wait(key);
+                    continue;
+                }
+            }
+            t->run_(t);
+        }
+        loc.ex_ = nullptr;
+        loc.wk_ = nullptr;
+    }
+
+    void post(task* t) {
+        if (auto wk = self()) {
+            wk->dq_.push(t);
+        }
+        else inject_.push(t);
+        ec_.notify();
+    }
+
+public:
+    explicit executor(unsigned threads = std::thread::hardware_concurrency()) {
+        if (threads == 0) threads = 1;
+        for (unsigned i = 0; i < threads; ++i) {
+            workers_.push_back(std::make_unique<worker>());
+        }
+        for (unsigned i = 0; i < threads; ++i) {
+            workers_[i]->th_ = std::thread { [this, i] { run(i); } };
+        }
+    }
+
+    executor(executor const &) = delete;
+    executor& operator=(executor const &) = delete;
+
+    // Runs every task already submitted, then joins the workers.
+    ~executor() {
+        stop_.store(true, std::memory_order_release);
+        ec_.notify();
+        for (auto& w : workers_) w->th_.join();
+    }
+
+    std::size_t size() const noexcept {
+        return workers_.size();
+    }
+
+    template <typename F>
+    void submit(F&& f) {
+        post(new task_of<std::decay_t<F>> { std::forward<F>(f), nullptr });
+    }
+
+    template <typename F>
+    void submit(wait_group& wg, F&& f) {
+        wg.count_.fetch_add(1, std::memory_order_relaxed);
+        post(new task_of<std::decay_t<F>> { std::forward<F>(f), &wg });
+    }
+
+    // Returns once every task submitted with wg has finished, running tasks in the meantime.
+    void wait(wait_group& wg) {
+        auto wk = self();
+        while (!wg.done()) {
+            if (auto t = find_task(wk)) {
+                t->run_(t);
+            }
+            else std::this_thread::yield();
+        }
+    }
+};
+
+} // namespace steal
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <atomic>
+
+namespace thread_id {
+
+/*
+ * A small id per thread, handed out in creation order.
+ * Shared by everything that spreads threads over per-thread slots, so a thread has the same id everywhere.
+*/
+inline unsigned get() noexcept {
+    static std::atomic<unsigned> counter { 0 };
+    thread_local unsigned id = counter.fetch_add(1, std::memory_order_relaxed);
+    return id;
+}
+
+} // namespace thread_id
@@ -3,15 +3,39 @@
 #include <tuple>
 #include <condition_variable>
 #include <mutex>
+#include <utility>
+#include <type_traits>
 
 namespace unsafe {
 
+namespace detail {
+
+// Parentheses when T has a matching constructor, braces otherwise, so aggregates can be emplaced too.
+template <typename T, typename... P>
+T make(P&&... pars) {
+    if constexpr (std::is_constructible<T, P&&...>::value) {
+        return T(std::forward<P>(pars)...);
+    }
+    else {
+        return T { std::forward<P>(pars)... };
+    }
+}
+
+} // namespace detail
+
 template <typename T>
 class pool {
 
     union node {
         T     data_;
         node* next_;
+
+        template <typename... P>
+        node(P&&... pars)
+            : data_ { std::forward<P>(pars)... }
+        {}
+
+        ~node() {}
     } * cursor_ = nullptr;
 
 public:
@@ -50,19 +74,36 @@ class queue {
 
     struct node {
         T      data_;
-        node * next_;
+        node * next_ = nullptr;
+
+        template <typename... P>
+        node(P&&... pars)
+            : data_(detail::make<T>(std::forward<P>(pars)...))
+        {}
     } * head_ = nullptr,
       * tail_ = nullptr;
 
     pool<node> allocator_;
 
 public:
+    using value_type = T;
+
+    ~queue() {
+        while (head_ != nullptr) {
+            auto temp = head_;
+            head_ = head_->next_;
+            temp->~node();
+            allocator_.free(temp);
+        }
+    }
+
     bool empty() const {
         return head_ == nullptr;
     }
 
-    bool push(T const & val) {
-        auto p = allocator_.alloc(val, nullptr);
+    template <typename... P>
+    bool emplace(P&&... pars) {
+        auto p = allocator_.alloc(std::forward<P>(pars)...);
         if (tail_ == nullptr) {
             head_ = tail_ = p;
         }
@@ -73,17 +114,36 @@ public:
         return true;
     }
 
-    std::tuple<T, bool> pop() {
+    bool push(T const & val) {
+        return emplace(val);
+    }
+
+    bool push(T&& val) {
+        return emplace(std::move(val));
+    }
+
+    bool pop(T& val) {
         if (head_ == nullptr) {
-            return {};
+            return false;
         }
-        auto ret  = std::make_tuple(head_->data_, true);
+        val = std::move(head_->data_);
         auto temp = head_;
         head_ = head_->next_;
         if (tail_ == temp) {
             tail_ = nullptr;
         }
+        temp->~node();
         allocator_.free(temp);
+        return true;
+    }
+
+    bool try_pop(T& val) {
+        return pop(val);
+    }
+
+    std::tuple<T, bool> pop() {
+        std::tuple<T, bool> ret {};
+        std::get<1>(ret) = pop(std::get<0>(ret));
         return ret;
     }
 };
@@ -97,12 +157,14 @@ class queue : unsafe::queue<T> {
 
     using base_t = unsafe::queue<T>;
 
-    std::mutex              lock_;
+    mutable std::mutex      lock_;
     std::condition_variable cond_;
 
     bool quit_ = false;
 
 public:
+    using value_type = T;
+
     ~queue() {
         quit();
     }
@@ -120,26 +182,45 @@ public:
         return base_t::empty();
     }
 
-    bool push(T const & val) {
+    template <typename... P>
+    bool emplace(P&&... pars) {
         bool ret;
         {
             auto guard = std::unique_lock { lock_ };
-            ret = base_t::push(val);
+            ret = base_t::emplace(std::forward<P>(pars)...);
         }
         cond_.notify_one();
         return ret;
     }
 
-    std::tuple<T, bool> pop() {
+    bool push(T const & val) {
+        return emplace(val);
+    }
+
+    bool push(T&& val) {
+        return emplace(std::move(val));
+    }
+
+    bool pop(T& val) {
         auto guard = std::unique_lock { lock_ };
         while (!quit_) {
-            auto ret = base_t::pop();
-            if (std::get<1>(ret)) {
-                return ret;
+            if (base_t::pop(val)) {
+                return true;
             }
             cond_.wait(guard);
         }
-        return {};
+        return false;
+    }
+
+    bool try_pop(T& val) {
+        auto guard = std::unique_lock { lock_ };
+        return base_t::pop(val);
+    }
+
+    std::tuple<T, bool> pop() {
+        std::tuple<T, bool> ret {};
+        std::get<1>(ret) = pop(std::get<0>(ret));
+        return ret;
     }
 };
 
@@ -0,0 +1,184 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <cstdint>
+#include <climits>
+#include <cerrno>
+
+#if defined(__linux__)
+#   include <linux/futex.h>
+#   include <sys/syscall.h>
+#   include <unistd.h>
+#   include <ctime>
+#else
+#   include <mutex>
+#   include <condition_variable>
+#endif
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#   include <intrin.h>
+#endif
+
+namespace wait_strategy {
+namespace detail {
+
+inline void cpu_pause() noexcept {
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+    _mm_pause();
+#elif defined(__i386__) || defined(__x86_64__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) || (defined(__arm__) && (__ARM_ARCH >= 7))
+    __asm__ __volatile__("yield" ::: "memory");
+#else
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+#endif
+}
+
+} // namespace detail
+
+/*
+ * Eventcount - lets a thread sleep until some lock-free condition may have changed.
+ *
+ * Waiter:   auto key = ec.prepare_wait();
+ *           if (condition()) ec.cancel_wait();
+ *           else             ec.commit_wait(key);
+ * Notifier: make condition() true, then ec.notify().
+ *
+ * The low bit of state_ says someone has prepared to wait since the last notification,
+ * the other bits count notifications. notify() is a fence and a load while the bit is clear,
+ * and only the first notify() after a waiter shows up makes a syscall, which wakes all sleepers.
+*/
+class eventcount {
+
+    std::atomic<std::uint32_t> state_ { 0 };
+
+#if !defined(__linux__)
+    std::mutex              lock_;
+    std::condition_variable cond_;
+#endif
+
+public:
+    std::uint32_t prepare_wait() {
+        auto key = state_.fetch_or(1, std::memory_order_seq_cst) | 1;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        return key;
+    }
+
+    void cancel_wait() {
+        // the waiting bit stays set, the next notify() just wakes nobody
+    }
+
+    void commit_wait(std::uint32_t key) {
+#if defined(__linux__)
+        ::syscall(SYS_futex, &state_, FUTEX_WAIT_PRIVATE, key, nullptr, nullptr, 0);
+#else
+        auto guard = std::unique_lock { lock_ };
+        cond_.wait(guard, [&] { return state_.load(std::memory_order_relaxed) != key; });
+#endif
+    }
+
+    /*
+     * Returns false if the timeout expired before a notification arrived.
+     * Like commit_wait(), it may also return early without one.
+    */
+    template <typename Rep, typename Period>
+    bool commit_wait(std::uint32_t key, std::chrono::duration<Rep, Period> const & timeout) {
+#if defined(__linux__)
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(timeout).count();
+        if (ns < 0) ns = 0;
+        timespec ts;
+        ts.tv_sec  = static_cast<decltype(ts.tv_sec )>(ns / 1000000000);
+        ts.tv_nsec = static_cast<decltype(ts.tv_nsec)>(ns % 1000000000);
+        return (::syscall(SYS_futex, &state_, FUTEX_WAIT_PRIVATE, key, &ts, nullptr, 0) == 0) ||
+               (errno != ETIMEDOUT);
+#else
+        auto guard = std::unique_lock { lock_ };
+        return cond_.wait_for(guard, timeout, [&] { return state_.load(std::memory_order_relaxed) != key; });
+#endif
+    }
+
+    void notify() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        auto curr = state_.load(std::memory_order_relaxed);
+        if ((curr & 1) == 0) {
+            return;
+        }
+        // clears the waiting bit and counts the notification in one step
+        if (!state_.compare_exchange_strong(curr, curr + 1, std::memory_order_seq_cst)) {
+            return; // another notifier got here first
+        }
+#if defined(__linux__)
+        ::syscall(SYS_futex, &state_, FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+#else
+        { auto guard = std::unique_lock { lock_ }; }
+        cond_.notify_all();
+#endif
+    }
+};
+
+/*
+ * Wait strategies for the full/empty conditions of the rings.
+ *
+ * wait_until(pred) returns once pred() is true,
+ * notify() is called after every change that may make a waiter's pred() true.
+*/
+
+// Spins with a cpu pause hint, never gives the core away. For dedicated cores.
+struct busy_spin {
+    template <typename F>
+    void wait_until(F&& pred) {
+        while (!pred()) detail::cpu_pause();
+    }
+
+    void notify() {}
+};
+
+// Spins SpinN times, then yields on every retry.
+template <unsigned SpinN = 64>
+struct spin_yield {
+    template <typename F>
+    void wait_until(F&& pred) {
+        for (unsigned k = 0; k < SpinN; ++k) {
+            if (pred()) return;
+            detail::cpu_pause();
+        }
+        while (!pred()) std::this_thread::yield();
+    }
+
+    void notify() {}
+};
+
+// Yields on every retry, without spinning first.
+using yield = spin_yield<0>;
+
+// Spins SpinN times, then sleeps on a futex until a notify(). For shared cores.
+template <unsigned SpinN = 256>
+class spin_park {
+
+    eventcount ec_;
+
+public:
+    template <typename F>
+    void wait_until(F&& pred) {
+        for (unsigned k = 0; k < SpinN; ++k) {
+            if (pred()) return;
+            detail::cpu_pause();
+        }
+        while (!pred()) {
+            auto key = ec_.prepare_wait();
+            if (pred()) {
+                ec_.cancel_wait();
+                return;
+            }
+            ec_.commit_wait(key);
+        }
+    }
+
+    void notify() {
+        ec_.notify();
+    }
+};
+
+} // namespace wait_strategy
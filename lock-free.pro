@@ -15,6 +15,17 @@ HEADERS += \
     include/queue_unsafe.h \
     include/queue_locked.h \
     include/queue_spsc.h \
-    include/queue_mpmc.h
+    include/queue_mpmc.h \
+    include/queue_mpsc.h \
+    include/queue_wait.h \
+    include/queue_blocking.h \
+    include/queue_reclaim.h \
+    include/queue_shm.h \
+    include/queue_priority.h \
+    include/queue_steal.h \
+    include/queue_async.h \
+    include/queue_stats.h \
+    include/queue_thread.h
 
 unix:LIBS += -lpthread
+unix:!macx:LIBS += -lrt
@@ -1,15 +1,35 @@
 #include <iostream>
+#include <sstream>
 #include <thread>
 #include <vector>
+#include <array>
+#include <algorithm>
+#include <numeric>
+#include <memory>
 #include <typeinfo>
 #include <string>
+#include <cmath>
 #include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <type_traits>
 
 #include "queue_unsafe.h"
 #include "queue_locked.h"
 #include "queue_spsc.h"
 #include "queue_mpmc.h"
+#include "queue_mpsc.h"
+#include "queue_blocking.h"
+#include "queue_priority.h"
+#include "queue_steal.h"
+#include "queue_async.h"
+
+#if defined(__linux__)
+#   include <cerrno>
+#   include <sys/wait.h>
+#   include <sys/resource.h>
+#   include "queue_shm.h"
+#endif/*__linux__*/
 
 #if defined(__GNUC__)
 #   include <memory>
@@ -37,6 +57,17 @@ std::string type_name() {
 #endif/*__GNUC__*/
 }
 
+// blocking adaptors, compared with cond::queue
+template <typename T> using blocking_queue = blocking::queue<mpmc::queue<T>>;
+template <typename T> using blocking_qring = blocking::queue<mpmc::qring<T>>;
+template <typename T> using blocking_spsc  = blocking::queue<spsc::qring<T>>;
+
+// 4 priority lanes, the benchmark pushes into the last one, so this is the cost of the lane bitmap
+template <typename T> using prio_qring = priority::queue<mpmc::qring2<T>, 4>;
+
+// mpmc::queue with epoch-based reclamation, compared with the plain pool
+template <typename T> using epoch_queue = mpmc::queue<T, mpmc::epoch_pool>;
+
 enum {
     loop_count = 11531520,
     rept_count = 1
@@ -135,43 +166,1519 @@ void benchmark_batch() {
     benchmark_batch<PushN, PopN, Q2, Qs...>();
 }
 
+#if defined(__linux__)
+// one producer process, one consumer process, through a shm::ring
+template <typename Q>
+void benchmark_shm() {
+    char const * name = "/lock-free-benchmark";
+    shm::ring<Q>::remove(name);
+    auto que = shm::ring<Q>::create(name);
+    if (!que) {
+        std::cout << "shm::ring<" << type_name<Q>() << ">: " << std::strerror(errno) << std::endl;
+        return;
+    }
+    capo::stopwatch<> sw { true };
+
+    pid_t pid = ::fork();
+    if (pid == 0) {
+        auto q = shm::ring<Q>::open(name);
+        if (!q) ::_exit(1);
+        for (int k = 0; k < rept_count; ++k) {
+            for (int n = 0; n < loop_count; ++n) {
+                while (!q->push(n)) {
+                    std::this_thread::yield();
+                }
+            }
+        }
+        while (!q->push(-1)) {
+            std::this_thread::yield();
+        }
+        ::_exit(0);
+    }
+
+    std::uint64_t ret = 0;
+    decltype(que->pop()) tp;
+    while (pid > 0) {
+        if (!std::get<1>(tp = que->pop())) {
+            std::this_thread::yield();
+            continue;
+        }
+        if (std::get<0>(tp) < 0) break;
+        ret += std::get<0>(tp);
+    }
+    int status = 0;
+    ::waitpid(pid, &status, 0);
+    shm::ring<Q>::remove(name);
+    if ((pid < 0) || (status != 0) || ((calc(loop_count) * rept_count) != ret)) {
+        std::cout << "fail... " << ret << std::endl;
+    }
+
+    auto t = sw.elapsed<std::chrono::milliseconds>();
+    std::cout << "shm::ring<" << type_name<Q>() << "> 1:1 (2 processes) - " << t << " ms" << std::endl;
+}
+#endif/*__linux__*/
+
+// what epoch_queue pays to give a burst back: the burst itself, then shrink() with its grace period
+void benchmark_shrink() {
+    epoch_queue<int> que;
+    for (int n = loop_count / 64; n <= loop_count / 4; n *= 4) {
+        capo::stopwatch<> sw { true };
+        for (int i = 0; i < n; ++i) que.push(i);
+        std::uint64_t ret = 0;
+        int val = 0;
+        for (int i = 0; i < n; ++i) {
+            que.pop(val);
+            ret += val;
+        }
+        auto t_burst = sw.elapsed<std::chrono::microseconds>();
+        sw.start();
+        que.shrink();
+        auto t_shrink = sw.elapsed<std::chrono::microseconds>();
+        if (calc(n) != ret) {
+            std::cout << "fail... " << ret << std::endl;
+        }
+        std::cout << type_name<decltype(que)>() << " burst of " << n << " - " << t_burst
+                  << " us, shrink() - " << t_shrink << " us" << std::endl;
+    }
+}
+
+// fork/join sum over [beg, end), halves are split off as tasks down to the grain
+void fork_join_sum(steal::executor& ex, int beg, int end, std::uint64_t& out) {
+    if ((end - beg) <= 4096) {
+        std::uint64_t r = 0;
+        for (int n = beg; n < end; ++n) r += n;
+        out = r;
+        return;
+    }
+    int mid = beg + (end - beg) / 2;
+    std::uint64_t l = 0, r = 0;
+    steal::wait_group wg;
+    ex.submit(wg, [&ex, beg, mid, &l] { fork_join_sum(ex, beg, mid, l); });
+    fork_join_sum(ex, mid, end, r);
+    ex.wait(wg);
+    out = l + r;
+}
+
+void benchmark_fork_join() {
+    unsigned max_n = (std::max)(std::thread::hardware_concurrency(), 1u);
+    for (unsigned n = 1; n <= max_n; n *= 2) {
+        steal::executor ex { n };
+        capo::stopwatch<> sw { true };
+        std::uint64_t ret = 0;
+        for (int k = 0; k < rept_count; ++k) {
+            std::uint64_t r = 0;
+            steal::wait_group wg;
+            ex.submit(wg, [&ex, &r] { fork_join_sum(ex, 0, loop_count, r); });
+            ex.wait(wg);
+            ret += r;
+        }
+        if ((calc(loop_count) * rept_count) != ret) {
+            std::cout << "fail... " << ret << std::endl;
+        }
+        auto t = sw.elapsed<std::chrono::milliseconds>();
+        std::cout << "steal::executor fork/join " << n << " workers - " << t << " ms" << std::endl;
+    }
+}
+
+// a record of the variable-length benchmark in a fixed slot, as big as the largest one
+struct fixed_record {
+    std::uint32_t size_;
+    unsigned char data_[2044];
+};
+
+// 1:1, records of 16 to 2044 bytes, each starts with its sequence number
+template <typename Q, typename Put, typename Get>
+void benchmark_records(Q& que, Put put, Get get) {
+    capo::stopwatch<> sw { true };
+    int cnt = (loop_count / 64);
+    std::uint64_t ret = 0;
+    std::thread consumer { [&] {
+        for (int i = 0; i < cnt;) {
+            std::uint32_t seq;
+            if (get(que, seq)) {
+                ret += seq;
+                ++i;
+            }
+            else std::this_thread::yield();
+        }
+    } };
+    std::uint32_t x = 2463534242u; // xorshift32
+    for (int i = 0; i < cnt; ++i) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        std::size_t n = 16 + x % 2029;
+        while (!put(que, static_cast<std::uint32_t>(i), n)) std::this_thread::yield();
+    }
+    consumer.join();
+    if (calc(cnt) != ret) {
+        std::cout << "fail... " << ret << std::endl;
+    }
+    auto t = sw.elapsed<std::chrono::milliseconds>();
+    std::cout << type_name<Q>() << " 1:1 (records of 16-2044 bytes) - " << t << " ms" << std::endl;
+}
+
+// the byte ring against a ring of fixed slots taking the same 64 KB
+void benchmark_records() {
+    {
+        spsc::qbip<65536> que;
+        benchmark_records(que, [](auto& q, std::uint32_t seq, std::size_t n) {
+            auto p = q.claim_push(n);
+            if (p == nullptr) return false;
+            std::memset(p, 0, n);
+            std::memcpy(p, &seq, sizeof(seq));
+            q.publish(n);
+            return true;
+        }, [](auto& q, std::uint32_t& seq) {
+            return q.pop([&seq](unsigned char const * p, std::size_t) {
+                std::memcpy(&seq, p, sizeof(seq));
+            });
+        });
+    }
+    {
+        spsc::qring<fixed_record, 32> que;
+        benchmark_records(que, [](auto& q, std::uint32_t seq, std::size_t n) {
+            auto r = q.claim_push();
+            if (r == nullptr) return false;
+            r->size_ = static_cast<std::uint32_t>(n);
+            std::memset(r->data_, 0, n);
+            std::memcpy(r->data_, &seq, sizeof(seq));
+            q.publish();
+            return true;
+        }, [](auto& q, std::uint32_t& seq) {
+            auto r = q.claim_pop();
+            if (r == nullptr) return false;
+            std::memcpy(&seq, r->data_, sizeof(seq));
+            q.release();
+            return true;
+        });
+    }
+}
+
+// an element of mpsc::queue, the producers push nodes made up front, so no push allocates
+struct mpsc_node : mpsc::hook {
+    int val_;
+};
+
+template <int PushN>
+void benchmark_mpsc() {
+    mpsc::queue<mpsc_node> que;
+    std::unique_ptr<mpsc_node[]> nodes { new mpsc_node[loop_count] };
+    capo::stopwatch<> sw { true };
+    int cnt = (loop_count / PushN);
+    std::thread producers[PushN];
+    for (int i = 0; i < PushN; ++i) {
+        producers[i] = std::thread { [&, i] {
+            for (int n = i * cnt; n < (i + 1) * cnt; ++n) {
+                nodes[n].val_ = n;
+                que.push(&nodes[n]);
+            }
+        } };
+    }
+    std::uint64_t ret = 0;
+    for (int i = 0; i < cnt * PushN;) {
+        if (auto p = que.pop()) {
+            ret += p->val_;
+            ++i;
+        }
+        else std::this_thread::yield();
+    }
+    for (auto& t : producers) t.join();
+    if (calc(cnt * PushN) != ret) {
+        std::cout << "fail... " << ret << std::endl;
+    }
+    auto t = sw.elapsed<std::chrono::milliseconds>();
+    std::cout << type_name<decltype(que)>() << " " << PushN << ":1 (intrusive) - " << t << " ms" << std::endl;
+}
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+// a coroutine nobody waits for, it runs right away until its first suspension
+struct detached {
+    struct promise_type {
+        detached get_return_object() noexcept { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+template <typename Q>
+detached async_produce(Q& que, int beg, int end, std::atomic<int>& left) {
+    for (int i = beg; i < end; ++i) {
+        co_await que.async_push(i);
+    }
+    left.fetch_sub(1, std::memory_order_release);
+}
+
+template <typename Q>
+detached async_consume(Q& que, std::uint64_t& sum, std::atomic<int>& left) {
+    while (1) {
+        auto [val, ok] = co_await que.async_pop();
+        if (!ok) break;
+        sum += val;
+    }
+    left.fetch_sub(1, std::memory_order_release);
+}
+
+// every coroutine is started on a thread of its own, then runs wherever its counterpart resumes it
+template <int PushN, int PopN, typename Q>
+void benchmark_async() {
+    Q que;
+    capo::stopwatch<> sw { true };
+    int cnt = (loop_count / PushN);
+    std::atomic<int> producers { PushN }, consumers { PopN };
+    std::uint64_t sums[PopN] {};
+    std::thread threads[PushN + PopN];
+    for (int i = 0; i < PopN; ++i) {
+        threads[i] = std::thread { [&, i] { async_consume(que, sums[i], consumers); } };
+    }
+    for (int i = 0; i < PushN; ++i) {
+        threads[PopN + i] = std::thread { [&, i] { async_produce(que, i * cnt, (i + 1) * cnt, producers); } };
+    }
+    for (auto& t : threads) t.join();
+    while (producers.load(std::memory_order_acquire) != 0) std::this_thread::yield();
+    que.quit();
+    while (consumers.load(std::memory_order_acquire) != 0) std::this_thread::yield();
+    std::uint64_t ret = 0;
+    for (auto s : sums) ret += s;
+    if (calc(cnt * PushN) != ret) {
+        std::cout << "fail... " << ret << std::endl;
+    }
+    auto t = sw.elapsed<std::chrono::milliseconds>();
+    std::cout << type_name<Q>() << " " << PushN << ":" << PopN << " (coroutines) - " << t << " ms" << std::endl;
+}
+#endif/*__cpp_impl_coroutine*/
+
+/*
+ * Smoke checks, run with --check (ctest runs them too).
+ * Each one drives a feature through a short script and compares the values and their order
+ * with what they have to be, instead of timing it. A failure prints "fail..." and what went wrong.
+*/
+namespace smoke {
+
+bool expect(bool ok, char const * what) {
+    if (!ok) std::cout << "fail... " << what << std::endl;
+    return ok;
+}
+
+// A producer id in the high bits and a sequence number in the low ones.
+constexpr std::uint32_t tag_of(std::uint32_t producer, std::uint32_t seq) {
+    return (producer << 24) | seq;
+}
+
+// mpmc::qring2::push_n/pop_n: batches keep their order, across the end of the ring too
+bool batches() {
+    bool ok = true;
+    mpmc::qring2<int, 8> que;
+    int in[6] = { 1, 2, 3, 4, 5, 6 }, out[8] {};
+    ok &= expect(que.push_n(in, 5) == 5, "push_n takes the whole batch");
+    ok &= expect(que.pop_n(out, 8) == 5, "pop_n stops at the backlog");
+    ok &= expect(std::equal(in, in + 5, out), "pop_n keeps the order of push_n");
+    ok &= expect(que.push_n(in, 6) == 6, "push_n across the end of the ring");
+    ok &= expect((que.pop_n(out, 2) == 2) && (que.pop_n(out + 2, 8) == 4), "pop_n across the end of the ring");
+    ok &= expect(std::equal(in, in + 6, out), "the order holds across the end of the ring");
+
+    // 2:2, every consumer sees each producer's elements in the order they were pushed
+    enum : std::uint32_t { producers = 2, consumers = 2, count = 20000, batch = 5 };
+    mpmc::qring2<std::uint32_t, 64> mq;
+    std::atomic<std::uint32_t> left { producers * count };
+    std::atomic<bool> in_order { true };
+    std::vector<std::thread> trds;
+    for (std::uint32_t p = 0; p < producers; ++p) {
+        trds.emplace_back([&, p] {
+            std::uint32_t buf[batch];
+            for (std::uint32_t i = 0; i < count; i += batch) {
+                for (std::uint32_t k = 0; k < batch; ++k) buf[k] = tag_of(p, i + k);
+                mq.push_n(buf, batch);
+            }
+        });
+    }
+    for (std::uint32_t c = 0; c < consumers; ++c) {
+        trds.emplace_back([&] {
+            std::int64_t last[producers];
+            std::fill(std::begin(last), std::end(last), -1);
+            std::uint32_t buf[batch];
+            while (left.load(std::memory_order_acquire) != 0) {
+                if (mq.empty()) {
+                    std::this_thread::yield();
+                    continue;
+                }
+                auto n = mq.pop_n(buf, batch);
+                for (std::size_t k = 0; k < n; ++k) {
+                    auto p = buf[k] >> 24, seq = buf[k] & 0xffffff;
+                    if (static_cast<std::int64_t>(seq) <= last[p]) in_order = false;
+                    last[p] = seq;
+                }
+                left.fetch_sub(static_cast<std::uint32_t>(n), std::memory_order_acq_rel);
+            }
+            mq.quit(); // wakes a consumer waiting for a ticket nobody will fill
+        });
+    }
+    for (auto& t : trds) t.join();
+    ok &= expect(in_order, "pop_n keeps each producer's order, 2:2");
+    return ok;
+}
+
+// spsc::qring and mpmc::qring2 claim/publish: elements are filled and read in place, in ticket order
+bool claims() {
+    bool ok = true;
+    spsc::qring<std::string, 4> sq;
+    for (int round = 0; round < 3; ++round) { // past the end of the ring
+        for (int i = 0; i < 3; ++i) {
+            auto p = sq.claim_push();
+            if (!expect(p != nullptr, "spsc::qring claim_push on a ring with room")) return false;
+            *p = std::to_string(round * 3 + i);
+            sq.publish();
+        }
+        ok &= expect(sq.claim_push() == nullptr, "spsc::qring claim_push on a full ring");
+        for (int i = 0; i < 3; ++i) {
+            auto p = sq.claim_pop();
+            if (!expect(p != nullptr, "spsc::qring claim_pop on a ring with elements")) return false;
+            ok &= expect(*p == std::to_string(round * 3 + i), "spsc::qring claim_pop in push order");
+            sq.release();
+        }
+        ok &= expect(sq.claim_pop() == nullptr, "spsc::qring claim_pop on an empty ring");
+    }
+
+    mpmc::qring2<std::string, 4> mq;
+    auto c1 = mq.claim_push();
+    auto c2 = mq.claim_push();
+    *c1 = "first";
+    *c2 = "second";
+    mq.publish(c2);
+    ok &= expect(mq.empty(), "qring2 holds back a slot published ahead of an earlier one");
+    mq.publish(c1);
+    auto r1 = mq.claim_pop();
+    auto r2 = mq.claim_pop();
+    ok &= expect(r1 && r2 && (*r1 == "first") && (*r2 == "second"), "qring2 claim_pop in ticket order");
+    mq.release(r2);
+    mq.release(r1);
+    for (int i = 0; i < 4; ++i) ok &= expect(mq.try_push(std::to_string(i)), "qring2 slots are free again after release");
+    ok &= expect(mq.full(), "qring2 full after capacity() pushes");
+    std::string val;
+    for (int i = 0; i < 4; ++i) ok &= expect(mq.try_pop(val) && (val == std::to_string(i)), "qring2 pops in order after release");
+    mq.quit();
+    ok &= expect(!mq.claim_pop(), "qring2 claim_pop is empty after quit() on an empty ring");
+    return ok;
+}
+
+// counts its live instances, so a check can see what a queue leaves behind
+struct tracked {
+    static int live_;
+    int val_ = 0;
+
+    tracked()                  { ++live_; }
+    tracked(int v) : val_(v)   { ++live_; }
+    tracked(tracked const & o) : val_(o.val_) { ++live_; }
+    tracked& operator=(tracked const &) = default;
+    ~tracked()                 { --live_; }
+};
+
+int tracked::live_ = 0;
+
+// mpmc::qring2 destroys exactly the elements it still holds, also with consumers past wt_ after quit()
+bool ring_teardown() {
+    bool ok = true;
+    {
+        mpmc::qring2<tracked, 8> que;
+        que.push(tracked { 0 });
+        que.push(tracked { 1 });
+        auto w = que.claim_push();   // ticket 2, built but never published
+        tracked val;
+        ok &= expect(que.pop(val) && (val.val_ == 0), "qring2 pops the first element");
+        auto r = que.claim_pop();    // ticket 1, never released
+        ok &= expect(w && r && (r->val_ == 1), "qring2 claims a slot on each side");
+        que.quit();
+        ok &= expect(!que.pop(val) && !que.pop(val), "qring2 pop fails after quit() past the published slots");
+        ok &= expect(tracked::live_ == 3, "qring2 holds the two claimed elements");
+    }
+    ok &= expect(tracked::live_ == 0, "qring2 destroys claimed elements and nothing else");
+    return ok;
+}
+
+// an aggregate, which C++17 can only build from its members with braces
+struct point {
+    int x_, y_;
+};
+
+template <typename Q>
+bool emplace_aggregate(char const * what) {
+    Q que;
+    bool ok = que.emplace(1, 2) && que.emplace(3, 4);
+    point p {};
+    ok = ok && que.pop(p) && (p.x_ == 1) && (p.y_ == 2);
+    ok = ok && que.pop(p) && (p.x_ == 3) && (p.y_ == 4);
+    return expect(ok, what);
+}
+
+// emplace() builds an aggregate from its members in every kind of queue
+bool aggregates() {
+    bool ok = true;
+    ok &= emplace_aggregate<lock::queue  <point>>("lock::queue emplaces an aggregate");
+    ok &= emplace_aggregate<cond::queue  <point>>("cond::queue emplaces an aggregate");
+    ok &= emplace_aggregate<spsc::queue  <point>>("spsc::queue emplaces an aggregate");
+    ok &= emplace_aggregate<spsc::qring  <point>>("spsc::qring emplaces an aggregate");
+    ok &= emplace_aggregate<spsc::qcache <point>>("spsc::qcache emplaces an aggregate");
+    ok &= emplace_aggregate<mpmc::queue  <point>>("mpmc::queue emplaces an aggregate");
+    ok &= emplace_aggregate<mpmc::qring  <point>>("mpmc::qring emplaces an aggregate");
+    ok &= emplace_aggregate<mpmc::qring2 <point>>("mpmc::qring2 emplaces an aggregate");
+    ok &= emplace_aggregate<spmc::qring  <point>>("spmc::qring emplaces an aggregate");
+    ok &= emplace_aggregate<mpmc::qlock  <point>>("mpmc::qlock emplaces an aggregate");
+    ok &= emplace_aggregate<mpmc::qarena <point>>("mpmc::qarena emplaces an aggregate");
+    ok &= emplace_aggregate<mpmc::qseg   <point>>("mpmc::qseg emplaces an aggregate");
+    ok &= emplace_aggregate<mpmc::qscq   <point>>("mpmc::qscq emplaces an aggregate");
+    ok &= emplace_aggregate<mpmc::qtoken <point>>("mpmc::qtoken emplaces an aggregate");
+    return ok;
+}
+
+/*
+ * mpmc::qring2: a producer a whole round ahead waits for the slot to be written and read,
+ * even while the first round's producer hasn't written it yet.
+*/
+bool laps() {
+    bool ok = true;
+    mpmc::qring2<int, 2> que;
+    auto c = que.claim_push(); // ticket 0, held back
+    que.push(1);               // ticket 1
+    std::atomic<bool> done { false };
+    std::thread lap { [&] {
+        que.push(2);           // ticket 2, the slot of ticket 0
+        done.store(true, std::memory_order_release);
+    } };
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    ok &= expect(!done.load(std::memory_order_acquire), "qring2 push waits for a slot whose first round isn't written yet");
+    *c = 0;
+    que.publish(c);
+    int val = -1;
+    for (int i = 0; i < 3; ++i) {
+        ok &= expect(que.pop(val) && (val == i), "qring2 pops the tickets in order after a lapped push");
+    }
+    lap.join();
+    return ok;
+}
+
+// mpmc::epoch_pool::shrink: free nodes are back on the heap when it returns, even with a reader in a guard
+bool reclamation() {
+    bool ok = true;
+    mpmc::epoch_pool<int> pool;
+    std::vector<int*> nodes;
+    for (int i = 0; i < 1000; ++i) nodes.push_back(pool.alloc(i));
+    for (int i = 0; i < 1000; ++i) ok &= expect(*nodes[i] == i, "epoch_pool alloc builds the element");
+    for (auto p : nodes) pool.free(p);
+    ok &= expect(pool.heap_nodes() == 1000, "epoch_pool keeps freed nodes until shrink()");
+    pool.shrink();
+    ok &= expect(pool.heap_nodes() == 0, "epoch_pool::shrink gives every free node back");
+
+    // a thread that may still read the nodes holds the grace period open
+    nodes.clear();
+    for (int i = 0; i < 100; ++i) nodes.push_back(pool.alloc(i));
+    for (auto p : nodes) pool.free(p);
+    std::atomic<int> state { 0 };
+    std::thread reader { [&] {
+        reclaim::guard g;
+        state.store(1, std::memory_order_release);
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        state.store(2, std::memory_order_release);
+    } };
+    while (state.load(std::memory_order_acquire) == 0) std::this_thread::yield();
+    pool.shrink();
+    ok &= expect(state.load(std::memory_order_acquire) == 2, "epoch_pool::shrink waits for a guard that was open");
+    ok &= expect(pool.heap_nodes() == 0, "epoch_pool::shrink gives the nodes back after the guard");
+    reader.join();
+
+    // shrink() also waits for nodes another thread's collect() has taken but not freed yet
+    std::atomic<bool> stop { false };
+    std::thread collector { [&] {
+        while (!stop.load(std::memory_order_relaxed)) reclaim::domain::instance().collect();
+    } };
+    for (int round = 0; round < 200; ++round) {
+        nodes.clear();
+        for (int i = 0; i < 16; ++i) nodes.push_back(pool.alloc(i));
+        for (auto p : nodes) pool.free(p);
+        pool.shrink();
+        ok &= expect(pool.heap_nodes() == 0, "epoch_pool::shrink gives the nodes back next to a collector");
+    }
+    stop.store(true, std::memory_order_relaxed);
+    collector.join();
+
+    // a queue keeps working, in order, after its pool shrank
+    mpmc::queue<int, mpmc::epoch_pool> que;
+    for (int round = 0; round < 2; ++round) {
+        for (int i = 0; i < 1000; ++i) que.push(i);
+        int val = -1;
+        for (int i = 0; i < 1000; ++i) ok &= expect(que.pop(val) && (val == i), "mpmc::queue<epoch_pool> pops in order around shrink()");
+        que.shrink();
+    }
+    return ok;
+}
+
+// reclaim::domain::drain waits for a release another thread's collect() is running, so a qseg can die at any time
+bool retire_race() {
+    bool ok = true;
+    auto& dom = reclaim::domain::instance();
+
+    // a callback that is still running when its owner drains
+    int owner = 0;
+    std::atomic<int> state { 0 };
+    dom.retire(&owner, &state, [](void*, void* p) {
+        auto s = static_cast<std::atomic<int>*>(p);
+        s->store(1, std::memory_order_release);
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        s->store(2, std::memory_order_release);
+    });
+    std::thread collector { [&] {
+        while (state.load(std::memory_order_acquire) == 0) dom.collect();
+    } };
+    while (state.load(std::memory_order_acquire) == 0) std::this_thread::yield();
+    dom.drain(&owner);
+    ok &= expect(state.load(std::memory_order_acquire) == 2, "domain::drain waits for a release in flight");
+    collector.join();
+
+    // short-lived queues die while another queue keeps retiring segments into the domain
+    std::atomic<bool> stop { false };
+    std::thread other { [&] {
+        mpmc::qseg<int, 4> que;
+        int val = 0;
+        while (!stop.load(std::memory_order_relaxed)) {
+            for (int i = 0; i < 16; ++i) que.push(i);
+            for (int i = 0; i < 16; ++i) que.pop(val);
+        }
+    } };
+    for (int round = 0; round < 200; ++round) {
+        mpmc::qseg<int, 4> que;
+        for (int i = 0; i < 64; ++i) que.push(i);
+        int val = -1;
+        for (int i = 0; i < 64; ++i) ok &= expect(que.pop(val) && (val == i), "mpmc::qseg pops in order next to another qseg");
+    }
+    stop.store(true, std::memory_order_relaxed);
+    other.join();
+    return ok;
+}
+
+// mpmc::queue counts its live elements only when it has a cap, and the cap holds
+bool node_cap() {
+    bool ok = true;
+    mpmc::queue<int> plain;
+    for (int i = 0; i < 100; ++i) ok &= expect(plain.push(i), "mpmc::queue without a cap takes every push");
+    mpmc::queue<int> capped { 0, 4 };
+    for (int i = 0; i < 4; ++i) ok &= expect(capped.push(i), "mpmc::queue takes pushes up to its cap");
+    ok &= expect(!capped.push(4), "mpmc::queue rejects a push past its cap");
+    int val = -1;
+    ok &= expect(capped.pop(val) && (val == 0), "mpmc::queue pops the first element");
+    ok &= expect(capped.push(4), "mpmc::queue takes a push again below its cap");
+    return ok;
+}
+
+// mpmc::qarena grows its arena past the first chunk, with producers racing to grow it too
+bool arena_growth() {
+    bool ok = true;
+    mpmc::qarena<int> que { 4 };
+    for (int i = 0; i < 10000; ++i) ok &= expect(que.push(i), "mpmc::qarena takes pushes past its first chunk");
+    int val = -1;
+    for (int i = 0; i < 10000; ++i) ok &= expect(que.pop(val) && (val == i), "mpmc::qarena pops in order across chunks");
+    ok &= expect(!que.pop(val), "mpmc::qarena is empty after the pops");
+
+    mpmc::qarena<std::uint32_t> mq { 4 };
+    std::thread producers[2];
+    for (std::uint32_t p = 0; p < 2; ++p) {
+        producers[p] = std::thread { [&mq, p] {
+            for (std::uint32_t i = 0; i < 5000; ++i) mq.push(tag_of(p, i));
+        } };
+    }
+    for (auto& t : producers) t.join();
+    std::uint32_t next[2] {}, v = 0;
+    bool in_order = true;
+    while (mq.pop(v)) {
+        auto p = v >> 24;
+        in_order = in_order && (p < 2) && ((v & 0xffffff) == next[p]++);
+    }
+    ok &= expect(in_order && (next[0] == 5000) && (next[1] == 5000), "mpmc::qarena keeps each producer's order while it grows");
+    return ok;
+}
+
+// mpmc::qtoken: a thread pushes through many short-lived queues next to a long-lived one
+bool token_churn() {
+    bool ok = true;
+    mpmc::qtoken<int> keep;
+    int val = -1;
+    for (int round = 0; round < 1000; ++round) {
+        mpmc::qtoken<int> que;
+        ok &= expect(que.push(round) && keep.push(round), "mpmc::qtoken implicit push");
+        ok &= expect(que.pop(val) && (val == round), "mpmc::qtoken pops from a short-lived queue");
+        ok &= expect(keep.pop(val) && (val == round), "mpmc::qtoken pops from the long-lived queue");
+    }
+    return ok;
+}
+
+// try_emplace on the rings derived from spsc::qring goes through their own multi-producer push
+template <typename Q>
+bool try_then_push(char const * what) {
+    Q que;
+    bool ok = que.try_emplace(1) && que.push(2) && que.try_emplace(3) && que.push(4);
+    int val = 0;
+    for (int i = 1; i <= 4; ++i) ok = ok && que.pop(val) && (val == i);
+    return expect(ok && !que.pop(val), what);
+}
+
+bool try_emplaces() {
+    bool ok = true;
+    ok &= try_then_push<mpmc::qlock<int, 16>>("mpmc::qlock try_emplace then push");
+    ok &= try_then_push<mpmc::qring<int, 16>>("mpmc::qring try_emplace then push");
+    return ok;
+}
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+template <typename Q>
+detached pop_one(Q& que, int& val, bool& ok, bool& done) {
+    auto [v, k] = co_await que.async_pop();
+    val  = v;
+    ok   = k;
+    done = true;
+}
+
+template <typename Q>
+detached push_one(Q& que, int val, bool& ok, bool& done) {
+    ok   = co_await que.async_push(val);
+    done = true;
+}
+
+// coroutines over a ring whose counterparts run on their own threads, the sum tells if anything got lost
+template <int PushN, int PopN, typename Q>
+bool async_sum(char const * what) {
+    Q que;
+    int const cnt = 20000;
+    std::atomic<int> producers { PushN }, consumers { PopN };
+    std::uint64_t sums[PopN] {};
+    std::thread threads[PushN + PopN];
+    for (int i = 0; i < PopN; ++i) {
+        threads[i] = std::thread { [&, i] { async_consume(que, sums[i], consumers); } };
+    }
+    for (int i = 0; i < PushN; ++i) {
+        threads[PopN + i] = std::thread { [&, i] { async_produce(que, i * cnt, (i + 1) * cnt, producers); } };
+    }
+    for (auto& t : threads) t.join();
+    while (producers.load(std::memory_order_acquire) != 0) std::this_thread::yield();
+    que.quit();
+    while (consumers.load(std::memory_order_acquire) != 0) std::this_thread::yield();
+    std::uint64_t ret = 0;
+    for (auto s : sums) ret += s;
+    return expect(ret == calc(cnt * PushN), what);
+}
+
+// async::queue: a waiter is resumed by its counterpart with the element, or with false after quit()
+bool asyncs() {
+    bool ok = true;
+    async::queue<mpmc::qring2<int, 4>> que;
+    int val = -1;
+    bool got = false, done = false;
+    pop_one(que, val, got, done);
+    ok &= expect(!done, "async_pop suspends on an empty ring");
+    ok &= expect(que.push(7), "push into a ring with a waiting popper");
+    ok &= expect(done && got && (val == 7), "push resumes the popper with its element");
+
+    for (int i = 0; i < 4; ++i) ok &= expect(que.push(i), "push fills the ring");
+    bool pushed = false;
+    done = false;
+    push_one(que, 4, pushed, done);
+    ok &= expect(!done, "async_push suspends on a full ring");
+    ok &= expect(que.pop(val) && (val == 0), "pop from a ring with a waiting pusher");
+    ok &= expect(done && pushed, "pop resumes the pusher, its element is in");
+    for (int i = 1; i <= 4; ++i) ok &= expect(que.pop(val) && (val == i), "async_push keeps the order");
+
+    done = false;
+    pop_one(que, val, got, done);
+    que.quit();
+    ok &= expect(done && !got, "quit() resumes a waiting popper with false");
+
+    ok &= async_sum<1, 1, async::queue<spsc::qring <int, 16>>>("async::queue<spsc::qring> 1:1 loses nothing");
+    ok &= async_sum<4, 4, async::queue<mpmc::qring2<int, 16>>>("async::queue<mpmc::qring2> 4:4 loses nothing");
+    return ok;
+}
+#endif/*__cpp_impl_coroutine*/
+
+struct check {
+    char const * name_;
+    bool       (*run_)();
+};
+
+check const checks[] = {
+    { "mpmc::qring2 push_n/pop_n", batches },
+    { "spsc::qring, mpmc::qring2 claim/publish", claims },
+    { "emplace of an aggregate", aggregates },
+    { "mpmc::qring2 lapped producer", laps },
+    { "mpmc::qlock, mpmc::qring try_emplace", try_emplaces },
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+    { "async::queue", asyncs },
+#endif/*__cpp_impl_coroutine*/
+    { "mpmc::qring2 teardown after quit()", ring_teardown },
+    { "mpmc::queue cap", node_cap },
+    { "mpmc::qarena growth", arena_growth },
+    { "mpmc::qtoken short-lived queues", token_churn },
+    { "mpmc::epoch_pool shrink", reclamation },
+    { "mpmc::qseg destroyed while another queue retires", retire_race },
+};
+
 int main() {
+    bool all_ok = true;
+    for (auto& c : checks) {
+        bool ok = c.run_();
+        std::cout << c.name_ << (ok ? " - ok" : " - fail...") << std::endl;
+        all_ok = all_ok && ok;
+    }
+    return all_ok ? 0 : 1;
+}
+
+} // namespace smoke
+
+/*
+ * Command line driver, see usage(). Without arguments main() runs the fixed suite below.
+ *
+ * Each run is repeated --reps times. The report gives ops/sec (elements through the queue per second)
+ * as the median, mean and standard deviation over the repetitions, and the peak resident set size
+ * of the process so far.
+ *
+ * The latency mode stamps every element with steady_clock at push, each consumer records
+ * the time to its pop in a histogram of its own. The ping-pong mode sends one element at a time
+ * through a pair of queues and records the round trips. Both report p50/p99/p99.9/max
+ * over all the repetitions.
+*/
+namespace driver {
+
+// An element of Size bytes, id_ is what the consumers add up, or the push time in the latency mode.
+template <std::size_t Size>
+struct payload {
+    static_assert(Size >= sizeof(std::uint64_t), "A payload holds at least its id.");
+
+    std::uint64_t id_;
+    std::array<char, Size - sizeof(std::uint64_t)> pad_;
+};
+
+constexpr std::uint64_t end_of_stream = ~std::uint64_t(0);
+
+constexpr std::size_t payload_sizes[] = { 8, 16, 64, 256, 1024 };
+
+enum {
+    pingpong_count = 100000     // default round trips of the ping-pong mode
+};
+
+enum class mode {
+    throughput,
+    latency,
+    pingpong
+};
+
+inline std::uint64_t now_ns() {
+    return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+/*
+ * Log-linear histogram of nanoseconds, in the manner of HdrHistogram:
+ * values below 2^sub_bits are exact, above that each power of two is cut into 2^(sub_bits-1) buckets,
+ * so a value is known within 1/32 of itself. Recording is an index computation and an increment.
+*/
+class histogram {
+    enum : unsigned {
+        sub_bits  = 6,
+        sub_count = 1u << sub_bits,
+        half      = sub_count / 2,
+        buckets   = sub_count + (64 - sub_bits) * half
+    };
+
+    std::vector<std::uint64_t> counts_ = std::vector<std::uint64_t>(buckets);
+    std::uint64_t total_ = 0;
+    std::uint64_t max_   = 0;
+
+    static unsigned msb_of(std::uint64_t v) noexcept {
+#if defined(__GNUC__)
+        return 63u - static_cast<unsigned>(__builtin_clzll(v));
+#else
+        unsigned i = 0;
+        while (v >>= 1) ++i;
+        return i;
+#endif/*__GNUC__*/
+    }
+
+    static std::size_t index_of(std::uint64_t v) noexcept {
+        if (v < sub_count) return static_cast<std::size_t>(v);
+        unsigned shift = msb_of(v) - sub_bits + 1;
+        return sub_count + (shift - 1) * half + static_cast<std::size_t>((v >> shift) - half);
+    }
+
+    // The largest value that lands in bucket i.
+    static std::uint64_t upper_of(std::size_t i) noexcept {
+        if (i < sub_count) return i;
+        auto shift = static_cast<unsigned>((i - sub_count) / half) + 1;
+        auto top   = static_cast<std::uint64_t>((i - sub_count) % half) + half;
+        return ((top + 1) << shift) - 1;
+    }
+
+public:
+    void record(std::uint64_t v) noexcept {
+        ++counts_[index_of(v)];
+        ++total_;
+        if (v > max_) max_ = v;
+    }
+
+    void merge(histogram const & other) {
+        for (std::size_t i = 0; i < buckets; ++i) counts_[i] += other.counts_[i];
+        total_ += other.total_;
+        max_ = (std::max)(max_, other.max_);
+    }
+
+    std::uint64_t count() const noexcept { return total_; }
+    std::uint64_t max  () const noexcept { return max_;   }
+
+    // The value at or below which a fraction p of the records fall, rounded up to its bucket.
+    std::uint64_t percentile(double p) const noexcept {
+        if (total_ == 0) return 0;
+        auto rank = static_cast<std::uint64_t>(std::ceil(p * static_cast<double>(total_)));
+        if (rank == 0) rank = 1;
+        std::uint64_t seen = 0;
+        for (std::size_t i = 0; i < buckets; ++i) {
+            seen += counts_[i];
+            if (seen >= rank) return (std::min)(upper_of(i), max_);
+        }
+        return max_;
+    }
+};
+
+// How --capacity reaches a queue.
+enum class capacity_kind {
+    none,   // fixed at compile time, the option is ignored
+    ring,   // the runtime_capacity variant of the ring is built with it
+    limit   // a linked queue built with it as its cap on live elements
+};
+
+// runtime-capacity variants of the rings
+template <typename T> using spsc_qring_n     = spsc::qring <T, spsc::runtime_capacity>;
+template <typename T> using spsc_qcache_n    = spsc::qcache<T, spsc::runtime_capacity>;
+template <typename T> using spmc_qring_n     = spmc::qring <T, spsc::runtime_capacity>;
+template <typename T> using mpmc_qlock_n     = mpmc::qlock <T, spsc::runtime_capacity>;
+template <typename T> using mpmc_qring_n     = mpmc::qring <T, spsc::runtime_capacity>;
+template <typename T> using mpmc_qring2_n    = mpmc::qring2<T, spsc::runtime_capacity>;
+template <typename T> using blocking_qring_n = blocking::queue<mpmc::qring<T, spsc::runtime_capacity>>;
+template <typename T> using blocking_spsc_n  = blocking::queue<spsc::qring<T, spsc::runtime_capacity>>;
+
+// variants with stats::counters, for --stats
+template <typename T> using counted_pool     = mpmc::pool<T, stats::counters>;
+template <typename T> using mpmc_queue_s     = mpmc::queue <T, counted_pool, stats::counters>;
+template <typename T> using spsc_queue_s     = spsc::queue <T, stats::counters>;
+template <typename T> using spsc_qring_s     = spsc::qring <T, spsc::default_capacity, stats::counters>;
+template <typename T> using spsc_qcache_s    = spsc::qcache<T, spsc::default_capacity, stats::counters>;
+template <typename T> using spmc_qring_s     = spmc::qring <T, spsc::default_capacity, stats::counters>;
+template <typename T> using mpmc_qlock_s     = mpmc::qlock <T, spsc::default_capacity, wait_strategy::yield, stats::counters>;
+template <typename T> using mpmc_qring_s     = mpmc::qring <T, spsc::default_capacity, stats::counters>;
+template <typename T> using mpmc_qring2_s    = mpmc::qring2<T, spsc::default_capacity, wait_strategy::yield, stats::counters>;
+template <typename T> using mpmc_qarena_s    = mpmc::qarena<T, stats::counters>;
+template <typename T> using spsc_qring_ns    = spsc::qring <T, spsc::runtime_capacity, stats::counters>;
+template <typename T> using spsc_qcache_ns   = spsc::qcache<T, spsc::runtime_capacity, stats::counters>;
+template <typename T> using spmc_qring_ns    = spmc::qring <T, spsc::runtime_capacity, stats::counters>;
+template <typename T> using mpmc_qlock_ns    = mpmc::qlock <T, spsc::runtime_capacity, wait_strategy::yield, stats::counters>;
+template <typename T> using mpmc_qring_ns    = mpmc::qring <T, spsc::runtime_capacity, stats::counters>;
+template <typename T> using mpmc_qring2_ns   = mpmc::qring2<T, spsc::runtime_capacity, wait_strategy::yield, stats::counters>;
+
+struct config {
+    driver::mode  mode_     = mode::throughput;
+    int           push_n_   = 1;
+    int           pop_n_    = 1;
+    std::uint64_t ops_      = loop_count;
+    std::size_t   payload_  = 8;
+    std::size_t   capacity_ = 0;    // 0: the queue's own default
+};
+
+// What one run leaves behind, hist_ is only filled by the latency and ping-pong modes.
+struct sample {
+    double        seconds_ = 0;
+    histogram     hist_;
+    stats::report stats_;   // zero unless the queue counts
+};
+
+template <typename Q>
+void collect(Q const & que, sample& out) {
+    if constexpr (stats::has_stats<Q>::value) {
+        out.stats_ += que.stats();
+    }
+}
+
+// Runs cfg once on a new Q, returns false if the consumers didn't get every element.
+template <typename Q, typename... A>
+bool run_once(config const & cfg, sample& out, A... args) {
+    using value_t = typename Q::value_type;
+
+    auto que = std::make_unique<Q>(args...);
+    bool stamp = (cfg.mode_ == mode::latency);
+    std::uint64_t cnt = cfg.ops_ / cfg.push_n_;
+    std::atomic<int>  ready { 0 };
+    std::atomic<bool> go    { false };
+    std::atomic<int>  push_end { 0 };
+    auto wait_go = [&] {
+        ready.fetch_add(1, std::memory_order_acq_rel);
+        while (!go.load(std::memory_order_acquire)) std::this_thread::yield();
+    };
+
+    std::vector<std::thread> push_trds;
+    for (int i = 0; i < cfg.push_n_; ++i) {
+        push_trds.emplace_back([&, i] {
+            wait_go();
+            value_t val {};
+            std::uint64_t beg = i * cnt;
+            for (auto n = beg; n < (beg + cnt); ++n) {
+                val.id_ = stamp ? now_ns() : n;
+                while (!que->push(val)) std::this_thread::yield();
+            }
+            val.id_ = end_of_stream;
+            while (!que->push(val)) std::this_thread::yield();
+        });
+    }
+
+    // the sum of ids, or the number of elements in the latency mode
+    std::vector<std::uint64_t> sum(cfg.pop_n_);
+    std::vector<histogram>     hists(stamp ? cfg.pop_n_ : 0);
+    std::vector<std::thread>   pop_trds;
+    for (int i = 0; i < cfg.pop_n_; ++i) {
+        pop_trds.emplace_back([&, i] {
+            wait_go();
+            decltype(que->pop()) tp;
+            std::uint64_t s = 0;
+            while (push_end.load(std::memory_order_acquire) < cfg.push_n_) {
+                while (std::get<1>(tp = que->pop())) {
+                    auto id = std::get<0>(tp).id_;
+                    if (id == end_of_stream) {
+                        if ((push_end.fetch_add(1, std::memory_order_release) + 1) >= cfg.push_n_) {
+                            que->quit();
+                            sum[i] = s;
+                            return;
+                        }
+                    }
+                    else if (stamp) {
+                        hists[i].record(now_ns() - id);
+                        ++s;
+                    }
+                    else s += id;
+                }
+                std::this_thread::yield();
+            }
+            sum[i] = s;
+        });
+    }
+
+    while (ready.load(std::memory_order_acquire) < (cfg.push_n_ + cfg.pop_n_)) std::this_thread::yield();
+    capo::stopwatch<> sw { true };
+    go.store(true, std::memory_order_release);
+    for (auto& t : pop_trds) t.join();
+    out.seconds_ = std::chrono::duration<double>(sw.elapsed()).count();
+    for (auto& t : push_trds) t.join();
+
+    for (auto& h : hists) out.hist_.merge(h);
+    collect(*que, out);
+    auto got = std::accumulate(sum.begin(), sum.end(), std::uint64_t(0));
+    return got == (stamp ? (cnt * cfg.push_n_) : calc(cnt * cfg.push_n_));
+}
+
+// Sends ops_ elements one at a time through ping and back through pong, timing each round trip.
+template <typename Q, typename... A>
+bool run_pingpong(config const & cfg, sample& out, A... args) {
+    using value_t = typename Q::value_type;
+
+    auto ping = std::make_unique<Q>(args...);
+    auto pong = std::make_unique<Q>(args...);
+    std::thread echo {[&] {
+        value_t val {};
+        for (std::uint64_t n = 0; n < cfg.ops_; ++n) {
+            while (!ping->pop(val)) std::this_thread::yield();
+            while (!pong->push(val)) std::this_thread::yield();
+        }
+    }};
+
+    bool ok = true;
+    value_t val {};
+    capo::stopwatch<> sw { true };
+    for (std::uint64_t n = 0; n < cfg.ops_; ++n) {
+        val.id_ = n;
+        auto beg = now_ns();
+        while (!ping->push(val)) std::this_thread::yield();
+        while (!pong->pop(val)) std::this_thread::yield();
+        out.hist_.record(now_ns() - beg);
+        ok = ok && (val.id_ == n);
+    }
+    out.seconds_ = std::chrono::duration<double>(sw.elapsed()).count();
+    echo.join();
+    collect(*ping, out);
+    collect(*pong, out);
+    return ok;
+}
+
+template <typename Q, typename... A>
+bool launch(config const & cfg, sample& out, A... args) {
+    if (cfg.mode_ == mode::pingpong) return run_pingpong<Q>(cfg, out, args...);
+    return run_once<Q>(cfg, out, args...);
+}
+
+template <typename T, template <typename> class Queue, capacity_kind Kind, template <typename> class Sized>
+bool run_sized(config const & cfg, sample& out) {
+    if constexpr (Kind == capacity_kind::ring) {
+        if (cfg.capacity_ != 0) return launch<Sized<T>>(cfg, out, cfg.capacity_);
+    }
+    else if constexpr (Kind == capacity_kind::limit) {
+        if (cfg.capacity_ != 0) return launch<Queue<T>>(cfg, out, std::size_t(0), cfg.capacity_);
+    }
+    return launch<Queue<T>>(cfg, out);
+}
+
+template <template <typename> class Queue, capacity_kind Kind, template <typename> class Sized = Queue>
+bool run(config const & cfg, sample& out) {
+    switch (cfg.payload_) {
+    case 8   : return run_sized<payload<8>   , Queue, Kind, Sized>(cfg, out);
+    case 16  : return run_sized<payload<16>  , Queue, Kind, Sized>(cfg, out);
+    case 64  : return run_sized<payload<64>  , Queue, Kind, Sized>(cfg, out);
+    case 256 : return run_sized<payload<256> , Queue, Kind, Sized>(cfg, out);
+    case 1024: return run_sized<payload<1024>, Queue, Kind, Sized>(cfg, out);
+    default  : return false;
+    }
+}
+
+struct entry {
+    char const *  name_;
+    int           max_push_;    // 0: any number
+    int           max_pop_;
+    capacity_kind kind_;
+    bool        (*run_)(config const &, sample&);
+    bool        (*stats_run_)(config const &, sample&); // the same queue with stats::counters, if it takes a policy
+};
+
+entry const entries[] = {
+    { "lock::queue"   , 0, 0, capacity_kind::limit, run<lock::queue   , capacity_kind::limit>, nullptr },
+    { "cond::queue"   , 0, 0, capacity_kind::none , run<cond::queue   , capacity_kind::none >, nullptr },
+    { "blocking_queue", 0, 0, capacity_kind::limit, run<blocking_queue, capacity_kind::limit>, nullptr },
+    { "blocking_qring", 0, 0, capacity_kind::ring , run<blocking_qring, capacity_kind::ring , blocking_qring_n>, nullptr },
+    { "blocking_spsc" , 1, 1, capacity_kind::ring , run<blocking_spsc , capacity_kind::ring , blocking_spsc_n >, nullptr },
+    { "mpmc::queue"   , 0, 0, capacity_kind::limit, run<mpmc::queue   , capacity_kind::limit>,
+                                                    run<mpmc_queue_s  , capacity_kind::limit> },
+    { "epoch_queue"   , 0, 0, capacity_kind::limit, run<epoch_queue   , capacity_kind::limit>, nullptr },
+    { "mpmc::qseg"    , 0, 0, capacity_kind::none , run<mpmc::qseg    , capacity_kind::none >, nullptr },
+    { "mpmc::qarena"  , 0, 0, capacity_kind::none , run<mpmc::qarena  , capacity_kind::none >,
+                                                    run<mpmc_qarena_s , capacity_kind::none > },
+    { "spsc::queue"   , 1, 1, capacity_kind::limit, run<spsc::queue   , capacity_kind::limit>,
+                                                    run<spsc_queue_s  , capacity_kind::limit> },
+    { "mpmc::qlock"   , 0, 0, capacity_kind::ring , run<mpmc::qlock   , capacity_kind::ring , mpmc_qlock_n    >,
+                                                    run<mpmc_qlock_s  , capacity_kind::ring , mpmc_qlock_ns   > },
+    { "mpmc::qring"   , 0, 0, capacity_kind::ring , run<mpmc::qring   , capacity_kind::ring , mpmc_qring_n    >,
+                                                    run<mpmc_qring_s  , capacity_kind::ring , mpmc_qring_ns   > },
+    { "spmc::qring"   , 1, 0, capacity_kind::ring , run<spmc::qring   , capacity_kind::ring , spmc_qring_n    >,
+                                                    run<spmc_qring_s  , capacity_kind::ring , spmc_qring_ns   > },
+    { "spsc::qring"   , 1, 1, capacity_kind::ring , run<spsc::qring   , capacity_kind::ring , spsc_qring_n    >,
+                                                    run<spsc_qring_s  , capacity_kind::ring , spsc_qring_ns   > },
+    { "spsc::qcache"  , 1, 1, capacity_kind::ring , run<spsc::qcache  , capacity_kind::ring , spsc_qcache_n   >,
+                                                    run<spsc_qcache_s , capacity_kind::ring , spsc_qcache_ns  > },
+    { "mpmc::qring2"  , 0, 0, capacity_kind::ring , run<mpmc::qring2  , capacity_kind::ring , mpmc_qring2_n   >,
+                                                    run<mpmc_qring2_s , capacity_kind::ring , mpmc_qring2_ns  > },
+    { "prio_qring"    , 0, 0, capacity_kind::none , run<prio_qring    , capacity_kind::none >, nullptr },
+    { "mpmc::qscq"    , 0, 0, capacity_kind::none , run<mpmc::qscq    , capacity_kind::none >, nullptr },
+    { "mpmc::qtoken"  , 0, 0, capacity_kind::none , run<mpmc::qtoken  , capacity_kind::none >, nullptr },
+};
+
+struct options {
+    std::vector<entry const *> queues_;
+    std::vector<int>           push_n_ { 1 };
+    std::vector<int>           pop_n_  { 1 };
+    config                     cfg_;
+    bool                       ops_set_ = false;
+    int                        reps_    = 5;
+    std::string                format_  = "text";
+    bool                       stats_   = false;
+};
+
+struct summary {
+    double        median_, mean_, stddev_;  // ops/sec
+    std::uint64_t p50_, p99_, p999_, max_;  // ns
+    long          max_rss_kb_;
+    bool          ok_;
+    stats::report stats_;                   // summed over the repetitions
+};
+
+long max_rss_kb() {
+#if defined(__linux__)
+    struct rusage ru;
+    if (::getrusage(RUSAGE_SELF, &ru) == 0) return ru.ru_maxrss;
+#endif/*__linux__*/
+    return 0;
+}
+
+summary measure(entry const & e, config const & cfg, int reps, bool counted) {
+    auto run = (counted && (e.stats_run_ != nullptr)) ? e.stats_run_ : e.run_;
+    std::vector<double> rates;
+    histogram hist;
+    stats::report st;
+    bool ok = true;
+    std::uint64_t total = (cfg.mode_ == mode::pingpong) ? cfg.ops_ : (cfg.ops_ / cfg.push_n_) * cfg.push_n_;
+    for (int k = 0; k < reps; ++k) {
+        sample smp;
+        ok = run(cfg, smp) && ok;
+        rates.push_back(static_cast<double>(total) / smp.seconds_);
+        hist.merge(smp.hist_);
+        st += smp.stats_;
+    }
+    std::sort(rates.begin(), rates.end());
+    auto n = rates.size();
+    summary sm {};
+    sm.median_ = (n % 2) ? rates[n / 2] : (rates[n / 2 - 1] + rates[n / 2]) / 2;
+    sm.mean_   = std::accumulate(rates.begin(), rates.end(), 0.0) / n;
+    double var = 0;
+    for (auto r : rates) var += (r - sm.mean_) * (r - sm.mean_);
+    sm.stddev_ = (n > 1) ? std::sqrt(var / (n - 1)) : 0;
+    sm.p50_    = hist.percentile(0.5);
+    sm.p99_    = hist.percentile(0.99);
+    sm.p999_   = hist.percentile(0.999);
+    sm.max_    = hist.max();
+    sm.max_rss_kb_ = max_rss_kb();
+    sm.ok_ = ok;
+    sm.stats_ = st;
+    return sm;
+}
+
+void usage(std::ostream& os, char const * prog) {
+    os << "usage: " << prog << " [options]\n"
+          "  -q, --queue NAMES      comma separated queue names, or \"all\" (default: all)\n"
+          "  -p, --producers LIST   comma separated producer counts (default: 1)\n"
+          "  -c, --consumers LIST   comma separated consumer counts (default: 1)\n"
+          "  -s, --payload BYTES    element size: 8, 16, 64, 256 or 1024 (default: 8)\n"
+          "  -n, --capacity N       ring capacity, or cap of a linked queue (default: the queue's own)\n"
+          "  -m, --mode MODE        throughput, latency or pingpong (default: throughput)\n"
+          "  -o, --ops N            elements per run, split over the producers (default: " << loop_count << "),\n"
+          "                         or round trips in the pingpong mode (default: " << pingpong_count << ")\n"
+          "  -r, --reps N           repetitions of each run (default: 5)\n"
+          "  -f, --format FMT       text, csv or json (default: text)\n"
+          "  -S, --stats            run the queues that take a statistics policy with stats::counters,\n"
+          "                         and report their counters (summed over the repetitions)\n"
+          "  -C, --check            run the smoke checks instead, and exit with 1 if any fails\n"
+          "  -l, --list             list the queue names\n"
+          "  -h, --help             show this help\n"
+          "Runs every queue with every producer and consumer count it supports,\n"
+          "the pingpong mode always runs 1:1 over two queues.\n";
+}
+
+std::vector<std::string> split(std::string const & s) {
+    std::vector<std::string> ret;
+    std::istringstream is { s };
+    for (std::string item; std::getline(is, item, ',');) {
+        if (!item.empty()) ret.push_back(item);
+    }
+    return ret;
+}
+
+bool parse_count(std::string const & s, std::uint64_t& out) {
+    char* end = nullptr;
+    auto v = std::strtoull(s.c_str(), &end, 10);
+    if (s.empty() || (*end != '\0') || (v == 0)) return false;
+    out = v;
+    return true;
+}
+
+bool parse_counts(std::string const & s, std::vector<int>& out) {
+    out.clear();
+    for (auto& item : split(s)) {
+        std::uint64_t v;
+        if (!parse_count(item, v) || (v > 4096)) return false;
+        out.push_back(static_cast<int>(v));
+    }
+    return !out.empty();
+}
+
+// Returns 0 to go on, otherwise the exit code + 1.
+int parse(int argc, char* argv[], options& opt) {
+    std::string queues = "all";
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if ((arg == "-h") || (arg == "--help")) {
+            usage(std::cout, argv[0]);
+            return 1;
+        }
+        if ((arg == "-l") || (arg == "--list")) {
+            for (auto& e : entries) std::cout << e.name_ << "\n";
+            return 1;
+        }
+        if ((arg == "-C") || (arg == "--check")) {
+            return smoke::main() + 1;
+        }
+        if ((arg == "-S") || (arg == "--stats")) {
+            opt.stats_ = true;
+            continue;
+        }
+        if ((i + 1) >= argc) {
+            std::cerr << argv[0] << ": missing or unknown option " << arg << "\n";
+            usage(std::cerr, argv[0]);
+            return 2;
+        }
+        std::string val = argv[++i];
+        std::uint64_t v = 0;
+        bool good = true;
+        if      ((arg == "-q") || (arg == "--queue"))     queues = val;
+        else if ((arg == "-p") || (arg == "--producers")) good = parse_counts(val, opt.push_n_);
+        else if ((arg == "-c") || (arg == "--consumers")) good = parse_counts(val, opt.pop_n_);
+        else if ((arg == "-s") || (arg == "--payload")) {
+            good = parse_count(val, v) &&
+                   (std::find(std::begin(payload_sizes), std::end(payload_sizes), v) != std::end(payload_sizes));
+            opt.cfg_.payload_ = static_cast<std::size_t>(v);
+        }
+        else if ((arg == "-n") || (arg == "--capacity")) {
+            good = parse_count(val, v) && (v <= (std::uint64_t(1) << 31));
+            opt.cfg_.capacity_ = static_cast<std::size_t>(v);
+        }
+        else if ((arg == "-m") || (arg == "--mode")) {
+            if      (val == "throughput") opt.cfg_.mode_ = mode::throughput;
+            else if (val == "latency")    opt.cfg_.mode_ = mode::latency;
+            else if (val == "pingpong")   opt.cfg_.mode_ = mode::pingpong;
+            else good = false;
+        }
+        else if ((arg == "-o") || (arg == "--ops")) {
+            good = parse_count(val, v);
+            opt.cfg_.ops_ = v;
+            opt.ops_set_  = true;
+        }
+        else if ((arg == "-r") || (arg == "--reps")) {
+            good = parse_count(val, v) && (v <= 1000);
+            opt.reps_ = static_cast<int>(v);
+        }
+        else if ((arg == "-f") || (arg == "--format")) {
+            good = (val == "text") || (val == "csv") || (val == "json");
+            opt.format_ = val;
+        }
+        else {
+            std::cerr << argv[0] << ": unknown option " << arg << "\n";
+            usage(std::cerr, argv[0]);
+            return 2;
+        }
+        if (!good) {
+            std::cerr << argv[0] << ": bad value for " << arg << ": " << val << "\n";
+            return 2;
+        }
+    }
+    for (auto& name : split(queues)) {
+        if (name == "all") {
+            for (auto& e : entries) opt.queues_.push_back(&e);
+            continue;
+        }
+        auto it = std::find_if(std::begin(entries), std::end(entries), [&](entry const & e) { return name == e.name_; });
+        if (it == std::end(entries)) {
+            std::cerr << argv[0] << ": unknown queue " << name << " (see --list)\n";
+            return 2;
+        }
+        opt.queues_.push_back(&*it);
+    }
+    if (opt.cfg_.mode_ == mode::pingpong) {
+        opt.push_n_ = opt.pop_n_ = { 1 };
+        if (!opt.ops_set_) opt.cfg_.ops_ = pingpong_count;
+    }
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    options opt;
+    if (auto r = parse(argc, argv, opt)) return r - 1;
+
+    auto hw = std::thread::hardware_concurrency();
+    bool timed = (opt.cfg_.mode_ != mode::throughput);
+    char const * mode_name = (opt.cfg_.mode_ == mode::latency)  ? "latency"  :
+                             (opt.cfg_.mode_ == mode::pingpong) ? "pingpong" : "throughput";
+    auto& os = std::cout;
+    if (opt.format_ == "csv") {
+        os << "mode,queue,producers,consumers,payload,capacity,ops,reps,"
+              "median_ops_s,mean_ops_s,stddev_ops_s,p50_ns,p99_ns,p999_ns,max_ns,max_rss_kb,hw_threads,ok";
+        if (opt.stats_) {
+            for (std::size_t i = 0; i < stats::event_count; ++i) os << "," << stats::name_of(stats::event(i));
+            os << ",peak_depth";
+        }
+        os << "\n";
+    }
+    else if (opt.format_ == "json") {
+        os << "[";
+    }
+    bool first = true, all_ok = true;
+    for (auto e : opt.queues_) {
+        if ((opt.cfg_.capacity_ != 0) && (e->kind_ == capacity_kind::none)) {
+            std::cerr << e->name_ << ": fixed capacity, --capacity is ignored\n";
+        }
+        bool counted = opt.stats_ && (e->stats_run_ != nullptr);
+        if (opt.stats_ && !counted) {
+            std::cerr << e->name_ << ": takes no statistics policy, runs without counters\n";
+        }
+        for (int push_n : opt.push_n_) for (int pop_n : opt.pop_n_) {
+            if (((e->max_push_ != 0) && (push_n > e->max_push_)) ||
+                ((e->max_pop_  != 0) && (pop_n  > e->max_pop_ ))) {
+                std::cerr << e->name_ << ": " << push_n << ":" << pop_n << " not supported, skipped\n";
+                continue;
+            }
+            auto cfg = opt.cfg_;
+            cfg.push_n_ = push_n;
+            cfg.pop_n_  = pop_n;
+            if (e->kind_ == capacity_kind::none) cfg.capacity_ = 0;
+            auto sm = measure(*e, cfg, opt.reps_, opt.stats_);
+            all_ok = all_ok && sm.ok_;
+            if (opt.format_ == "csv") {
+                os << mode_name << "," << e->name_ << "," << push_n << "," << pop_n << ","
+                   << cfg.payload_ << "," << cfg.capacity_ << "," << cfg.ops_ << "," << opt.reps_ << "," << std::fixed
+                   << sm.median_ << "," << sm.mean_ << "," << sm.stddev_ << std::defaultfloat << ",";
+                if (timed) os << sm.p50_ << "," << sm.p99_ << "," << sm.p999_ << "," << sm.max_ << ",";
+                else       os << ",,,,";
+                os << sm.max_rss_kb_ << "," << hw << "," << (sm.ok_ ? 1 : 0);
+                if (counted) {
+                    for (auto n : sm.stats_.counts_) os << "," << n;
+                    os << "," << sm.stats_.peak_depth_;
+                }
+                else if (opt.stats_) {
+                    os << std::string(stats::event_count + 1, ',');
+                }
+                os << std::endl;
+            }
+            else if (opt.format_ == "json") {
+                os << (first ? "\n" : ",\n") << std::fixed
+                   << "  {\"mode\": \"" << mode_name << "\", \"queue\": \"" << e->name_ << "\", \"producers\": " << push_n << ", \"consumers\": " << pop_n
+                   << ", \"payload\": " << cfg.payload_ << ", \"capacity\": " << cfg.capacity_
+                   << ", \"ops\": " << cfg.ops_ << ", \"reps\": " << opt.reps_
+                   << ", \"median_ops_s\": " << sm.median_ << ", \"mean_ops_s\": " << sm.mean_
+                   << ", \"stddev_ops_s\": " << sm.stddev_ << std::defaultfloat;
+                if (timed) {
+                    os << ", \"p50_ns\": " << sm.p50_ << ", \"p99_ns\": " << sm.p99_
+                       << ", \"p999_ns\": " << sm.p999_ << ", \"max_ns\": " << sm.max_;
+                }
+                os << ", \"max_rss_kb\": " << sm.max_rss_kb_ << ", \"hw_threads\": " << hw
+                   << ", \"ok\": " << (sm.ok_ ? "true" : "false");
+                if (counted) {
+                    os << ", \"stats\": {";
+                    for (std::size_t i = 0; i < stats::event_count; ++i) {
+                        os << "\"" << stats::name_of(stats::event(i)) << "\": " << sm.stats_.counts_[i] << ", ";
+                    }
+                    os << "\"peak_depth\": " << sm.stats_.peak_depth_ << "}";
+                }
+                os << "}" << std::flush;
+            }
+            else {
+                os << e->name_ << " " << push_n << ":" << pop_n << " payload " << cfg.payload_ << " - "
+                   << static_cast<std::uint64_t>(sm.median_) << " ops/s (median of " << opt.reps_
+                   << ", stddev " << static_cast<std::uint64_t>(sm.stddev_) << "), max rss "
+                   << sm.max_rss_kb_ << " KB" << (sm.ok_ ? "" : " fail...") << std::endl;
+                if (timed) {
+                    os << "    " << mode_name << " p50 " << sm.p50_ << " ns, p99 " << sm.p99_ << " ns, p99.9 "
+                       << sm.p999_ << " ns, max " << sm.max_ << " ns" << std::endl;
+                }
+                if (counted) {
+                    os << "    stats";
+                    for (std::size_t i = 0; i < stats::event_count; ++i) {
+                        os << (i ? ", " : " ") << stats::name_of(stats::event(i)) << " " << sm.stats_.counts_[i];
+                    }
+                    os << ", peak_depth " << sm.stats_.peak_depth_ << std::endl;
+                }
+            }
+            first = false;
+        }
+    }
+    if (opt.format_ == "json") {
+        os << (first ? "]" : "\n]") << std::endl;
+    }
+    return all_ok ? 0 : 1;
+}
+
+} // namespace driver
+
+int main(int argc, char* argv[]) {
+    if (argc > 1) {
+        return driver::main(argc, argv);
+    }
 //    for (int i = 0; i < 100; ++i) {
 //        std::cout << i << std::endl;
 
         benchmark<1, 1, lock::queue,
                         cond::queue,
+                        blocking_queue,
+                        blocking_qring,
+                        blocking_spsc,
                         mpmc::queue,
+                        epoch_queue,
+                        mpmc::qseg,
+                        mpmc::qarena,
                         spsc::queue,
                         mpmc::qlock,
                         mpmc::qring,
                         spmc::qring,
                         spsc::qring,
-                        mpmc::qring2>();
+                        spsc::qcache,
+                        mpmc::qring2,
+                        prio_qring,
+                        mpmc::qscq,
+                        mpmc::qtoken>();
 
         std::cout << std::endl;
 
         benchmark_batch<1, 8, lock::queue,
                               cond::queue,
+                              blocking_queue,
+                              blocking_qring,
                               mpmc::queue,
+                              epoch_queue,
+                              mpmc::qseg,
+                              mpmc::qarena,
                               mpmc::qlock,
                               mpmc::qring,
                               spmc::qring,
-                              mpmc::qring2>();
+                              mpmc::qring2,
+                              mpmc::qscq,
+                              mpmc::qtoken>();
 
         benchmark_batch<8, 1, lock::queue,
                               cond::queue,
+                              blocking_queue,
+                              blocking_qring,
                               mpmc::queue,
+                              epoch_queue,
+                              mpmc::qseg,
+                              mpmc::qarena,
                               mpmc::qlock,
                               mpmc::qring,
-                              mpmc::qring2>();
+                              mpmc::qring2,
+                              mpmc::qscq,
+                              mpmc::qtoken>();
 
         benchmark_batch<8, 8, lock::queue,
                               cond::queue,
+                              blocking_queue,
+                              blocking_qring,
                               mpmc::queue,
+                              epoch_queue,
+                              mpmc::qseg,
+                              mpmc::qarena,
                               mpmc::qlock,
                               mpmc::qring,
-                              mpmc::qring2>();
+                              mpmc::qring2,
+                              prio_qring,
+                              mpmc::qscq,
+                              mpmc::qtoken>();
+
+        benchmark_shrink();
+        std::cout << std::endl;
+
+        benchmark_fork_join();
+        std::cout << std::endl;
+
+        benchmark_records();
+        std::cout << std::endl;
+
+        benchmark_mpsc<1>();
+        benchmark_mpsc<8>();
+        std::cout << std::endl;
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+        benchmark_async<1, 1, async::queue<spsc::qring<int>>>();
+        benchmark_async<1, 1, async::queue<mpmc::qring2<int>>>();
+        benchmark_async<8, 8, async::queue<mpmc::qring2<int>>>();
+        std::cout << std::endl;
+#endif/*__cpp_impl_coroutine*/
+
+#if defined(__linux__)
+        benchmark_shm<spsc::qring<int>>();
+        benchmark_shm<mpmc::qring2<int>>();
+#endif/*__linux__*/
 //    }
     return 0;
 }